@@ -18,6 +18,17 @@ public:
 	point3 min() const { return minimum; }
 	point3 max() const { return maximum; }
 
+	point3 centroid() const
+	{
+		return 0.5 * (minimum + maximum);
+	}
+
+	double surface_area() const
+	{
+		auto d = maximum - minimum;
+		return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+	}
+
 	bool hit(const ray& r, double t_min, double t_max) const
 	{
 		for (int i = 0; i < 3; ++i)
@@ -38,7 +49,7 @@ public:
 aabb surrounding_box(aabb box0, aabb box1)
 {
 	point3 small(fmin(box0.min().x(), box1.min().x()), fmin(box0.min().y(), box1.min().y()), fmin(box0.min().z(), box1.min().z()));
-	point3 big(fmin(box0.max().x(), box1.max().x()), fmin(box0.max().y(), box1.max().y()), fmin(box0.max().z(), box1.max().z()));
+	point3 big(fmax(box0.max().x(), box1.max().x()), fmax(box0.max().y(), box1.max().y()), fmax(box0.max().z(), box1.max().z()));
 	return aabb(small, big);
 }
 #endif // !AABB_H
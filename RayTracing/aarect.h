@@ -21,7 +21,39 @@ public:
     xy_rect() {}
     xy_rect(double _x0, double _x1, double _y0, double _y1, double _k, shared_ptr<material> mat) : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {}
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+    {
+        return hit_closest(*this, r, t_min, t_max, rec);
+    }
+
+    // c.u and c.v hold the hit's x and y
+    virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec) const override
+    {
+        auto t = (k - r.origin().z()) / r.direction().z();
+        if (t < t_min || t > t_max)
+            return false;
+        auto x = r.origin().x() + t * r.direction().x();
+        auto y = r.origin().y() + t * r.direction().y();
+        if (x < x0 || x > x1 || y < y0 || y > y1)
+            return false;
+        c.t = t;
+        c.u = x;
+        c.v = y;
+        c.object = this;
+        return true;
+    }
+
+    virtual void resolve(const ray& r, const hit_candidate& c, hit_record& rec) const override;
+
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override
+    {
+        auto t = (k - r.origin().z()) / r.direction().z();
+        if (t < t_min || t > t_max)
+            return false;
+        auto x = r.origin().x() + t * r.direction().x();
+        auto y = r.origin().y() + t * r.direction().y();
+        return x >= x0 && x <= x1 && y >= y0 && y <= y1;
+    }
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
     {
@@ -30,23 +62,15 @@ public:
     }
 };
 
-bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+void xy_rect::resolve(const ray& r, const hit_candidate& c, hit_record& rec) const
 {
-    auto t = (k - r.origin().z()) / r.direction().z();
-    if (t < t_min || t > t_max)
-        return false;
-    auto x = r.origin().x() + t * r.direction().x();
-    auto y = r.origin().y() + t * r.direction().y();
-    if (x < x0 || x > x1 || y < y0 || y > y1)
-        return false;
-    rec.u = (x - x0) / (x1 - x0); // texture
-    rec.v = (y - y0) / (y1 - y0);
-    rec.t = t;
+    rec.u = (c.u - x0) / (x1 - x0); // texture
+    rec.v = (c.v - y0) / (y1 - y0);
+    rec.t = c.t;
     auto outward_normal = vec3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.pt = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
+    rec.pt = r.at(c.t);
 }
 
 
@@ -59,7 +83,39 @@ public:
     xz_rect() {}
     xz_rect(double _x0, double _x1, double _z0, double _z1, double _k, shared_ptr<material> mat) : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {}
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+    {
+        return hit_closest(*this, r, t_min, t_max, rec);
+    }
+
+    // c.u and c.v hold the hit's x and z
+    virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec) const override
+    {
+        auto t = (k - r.origin().y()) / r.direction().y();
+        if (t < t_min || t > t_max)
+            return false;
+        auto x = r.origin().x() + t * r.direction().x();
+        auto z = r.origin().z() + t * r.direction().z();
+        if (x < x0 || x > x1 || z < z0 || z > z1)
+            return false;
+        c.t = t;
+        c.u = x;
+        c.v = z;
+        c.object = this;
+        return true;
+    }
+
+    virtual void resolve(const ray& r, const hit_candidate& c, hit_record& rec) const override;
+
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override
+    {
+        auto t = (k - r.origin().y()) / r.direction().y();
+        if (t < t_min || t > t_max)
+            return false;
+        auto x = r.origin().x() + t * r.direction().x();
+        auto z = r.origin().z() + t * r.direction().z();
+        return x >= x0 && x <= x1 && z >= z0 && z <= z1;
+    }
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
     {
@@ -94,23 +150,15 @@ public:
     }
 };
 
-bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+void xz_rect::resolve(const ray& r, const hit_candidate& c, hit_record& rec) const
 {
-    auto t = (k - r.origin().y()) / r.direction().y();
-    if (t < t_min || t > t_max)
-        return false;
-    auto x = r.origin().x() + t * r.direction().x();
-    auto z = r.origin().z() + t * r.direction().z();
-    if (x < x0 || x > x1 || z < z0 || z > z1)
-        return false;
-    rec.u = (x - x0) / (x1 - x0); // texture
-    rec.v = (z - z0) / (z1 - z0);
-    rec.t = t;
+    rec.u = (c.u - x0) / (x1 - x0); // texture
+    rec.v = (c.v - z0) / (z1 - z0);
+    rec.t = c.t;
     auto outward_normal = vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.pt = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
+    rec.pt = r.at(c.t);
 }
 
 
@@ -123,7 +171,39 @@ public:
     yz_rect() {}
     yz_rect(double _z0, double _z1, double _y0, double _y1, double _k, shared_ptr<material> mat) : z0(_z0), z1(_z1), y0(_y0), y1(_y1), k(_k), mp(mat) {}
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+    {
+        return hit_closest(*this, r, t_min, t_max, rec);
+    }
+
+    // c.u and c.v hold the hit's z and y
+    virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec) const override
+    {
+        auto t = (k - r.origin().x()) / r.direction().x();
+        if (t < t_min || t > t_max)
+            return false;
+        auto z = r.origin().z() + t * r.direction().z();
+        auto y = r.origin().y() + t * r.direction().y();
+        if (z < z0 || z > z1 || y < y0 || y > y1)
+            return false;
+        c.t = t;
+        c.u = z;
+        c.v = y;
+        c.object = this;
+        return true;
+    }
+
+    virtual void resolve(const ray& r, const hit_candidate& c, hit_record& rec) const override;
+
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override
+    {
+        auto t = (k - r.origin().x()) / r.direction().x();
+        if (t < t_min || t > t_max)
+            return false;
+        auto z = r.origin().z() + t * r.direction().z();
+        auto y = r.origin().y() + t * r.direction().y();
+        return z >= z0 && z <= z1 && y >= y0 && y <= y1;
+    }
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
     {
@@ -132,23 +212,15 @@ public:
     }
 };
 
-bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+void yz_rect::resolve(const ray& r, const hit_candidate& c, hit_record& rec) const
 {
-    auto t = (k - r.origin().x()) / r.direction().x();
-    if (t < t_min || t > t_max)
-        return false;
-    auto z = r.origin().z() + t * r.direction().z();
-    auto y = r.origin().y() + t * r.direction().y();
-    if (z < z0 || z > z1 || y < y0 || y > y1)
-        return false;
-    rec.u = (y - y0) / (y1 - y0); // texture
-    rec.v = (z - z0) / (z1 - z0);
-    rec.t = t;
+    rec.u = (c.v - y0) / (y1 - y0); // texture
+    rec.v = (c.u - z0) / (z1 - z0);
+    rec.t = c.t;
     auto outward_normal = vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.pt = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
+    rec.pt = r.at(c.t);
 }
 
 #endif /* aarect_h */
@@ -0,0 +1,120 @@
+#pragma once
+#ifndef ACCEL_H
+#define ACCEL_H
+
+#include "hittable_list.h"
+#include "bvh.h"
+#include "flat_bvh.h"
+#include "wide_bvh.h"
+#include "quantized_bvh.h"
+#include "motion_bvh.h"
+#include "lazy_bvh.h"
+
+#include <memory>
+#include <string>
+
+using namespace std;
+
+// Acceleration structures the renderer can put over a list of hittables.
+enum class accel_type
+{
+	none,     // plain hittable_list, every object tested
+	bvh_node, // pointer based binary tree
+	binary,   // flat_bvh
+	bvh4,
+	bvh8,
+	bvh4q,    // quantized_bvh4, half the node memory of bvh4
+	motion,   // motion_bvh, boxes interpolated at the ray's time
+	lazy,     // lazy_bvh, nodes split by the first ray reaching them
+	automatic // see make_scene_accel
+};
+
+inline const char* accel_name(accel_type type)
+{
+	switch (type)
+	{
+	case accel_type::none: return "none";
+	case accel_type::bvh_node: return "bvh_node";
+	case accel_type::binary: return "binary";
+	case accel_type::bvh4: return "bvh4";
+	case accel_type::bvh8: return "bvh8";
+	case accel_type::bvh4q: return "bvh4q";
+	case accel_type::motion: return "motion";
+	case accel_type::lazy: return "lazy";
+	case accel_type::automatic: return "auto";
+	}
+	return "?";
+}
+
+inline bool parse_accel_type(const string& name, accel_type& type)
+{
+	for (auto t : { accel_type::none, accel_type::bvh_node, accel_type::binary, accel_type::bvh4, accel_type::bvh8, accel_type::bvh4q, accel_type::motion, accel_type::lazy, accel_type::automatic })
+	{
+		if (name == accel_name(t))
+		{
+			type = t;
+			return true;
+		}
+	}
+	return false;
+}
+
+inline shared_ptr<hittable> make_accel(const hittable_list& list, accel_type type, double time0, double time1,
+	const bvh_build_settings& settings = bvh_build_settings())
+{
+	if (list.objects.empty())
+		return make_shared<hittable_list>(list);
+
+	switch (type)
+	{
+	case accel_type::bvh_node: return make_shared<bvh_node>(list, time0, time1);
+	case accel_type::binary: return make_shared<flat_bvh>(list, time0, time1, settings);
+	case accel_type::bvh4: return make_shared<bvh4>(list, time0, time1, settings);
+	case accel_type::bvh8: return make_shared<bvh8>(list, time0, time1, settings);
+	case accel_type::bvh4q: return make_shared<quantized_bvh4>(list, time0, time1, settings);
+	case accel_type::motion: return make_shared<motion_bvh>(list, time0, time1, settings);
+	case accel_type::lazy: return make_shared<lazy_bvh>(list, time0, time1, settings);
+	default: return make_shared<hittable_list>(list);
+	}
+}
+
+// Below this many objects testing them all is faster than walking a tree, measured with
+// spheres: the flat list wins up to 12 objects and loses from 16 on.
+const size_t accel_list_threshold = 16;
+
+// Objects moving less than this many times their size during the shutter are traced
+// faster by a BVH8 over their swept boxes than by a motion_bvh.
+const double motion_accel_ratio = 3.0;
+
+// What the renderer puts over a list of objects. accel_type::automatic keeps short lists
+// as they are, uses a motion_bvh when objects move far during the shutter and a BVH8
+// otherwise; any other type is used as given. Objects without a bounding box cannot be
+// placed in a tree and are tested next to it.
+inline shared_ptr<hittable> make_scene_accel(const hittable_list& list, double time0, double time1,
+	accel_type type = accel_type::automatic, const bvh_build_settings& settings = bvh_build_settings())
+{
+	if (type == accel_type::automatic)
+	{
+		if (list.objects.size() < accel_list_threshold)
+			return make_shared<hittable_list>(list);
+		type = motion_ratio(list.objects, time0, time1) > motion_accel_ratio ? accel_type::motion : accel_type::bvh8;
+	}
+	if (type == accel_type::none)
+		return make_shared<hittable_list>(list);
+
+	hittable_list bounded, unbounded;
+	for (const auto& object : list.objects)
+	{
+		aabb box;
+		if (object->bounding_box(time0, time1, box))
+			bounded.add(object);
+		else
+			unbounded.add(object);
+	}
+	if (unbounded.objects.empty())
+		return make_accel(bounded, type, time0, time1, settings);
+
+	unbounded.add(make_scene_accel(bounded, time0, time1, type, settings));
+	return make_shared<hittable_list>(unbounded);
+}
+#endif // !ACCEL_H
@@ -0,0 +1,119 @@
+#pragma once
+#ifndef ADAPTIVE_SAMPLER_H
+#define ADAPTIVE_SAMPLER_H
+
+#include "vec3.h"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+inline double luminance(const color& c)
+{
+	return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+// Running estimate of one pixel. The variance of the luminance is tracked with
+// Welford's update, so it stays stable after hundreds of samples.
+struct pixel_stats
+{
+	color sum;
+	int n = 0;
+	double mean = 0;
+	double m2 = 0;
+
+	void add(const color& sample)
+	{
+		sum += sample;
+		++n;
+		auto y = luminance(sample);
+		auto delta = y - mean;
+		mean += delta / n;
+		m2 += delta * (y - mean);
+	}
+
+	// half width of the 95% confidence interval of the mean luminance
+	double error() const
+	{
+		if (n < 2)
+			return infinity;
+		return 1.96 * sqrt(m2 / (double(n - 1) * n));
+	}
+};
+
+struct adaptive_settings
+{
+	int min_spp = 8;
+	int max_spp = 100;
+	double relative_error = 0.05; // stop once error() < relative_error * pixel mean
+	double global_error = 0.0;    // or once error() < global_error * image mean, if set
+};
+
+class adaptive_sampler
+{
+public:
+	adaptive_settings settings;
+	vector<pixel_stats> pixels;
+	int image_width;
+	int image_height;
+	double tolerance = 0.0; // absolute tolerance derived from global_error
+
+	adaptive_sampler(int width, int height, const adaptive_settings& s)
+		: settings(s), pixels(size_t(width) * height), image_width(width), image_height(height) {}
+
+	pixel_stats& pixel(int i, int j)
+	{
+		return pixels[size_t(j) * image_width + i];
+	}
+
+	bool converged(const pixel_stats& p) const
+	{
+		if (p.n < settings.min_spp)
+			return false;
+		if (p.n >= settings.max_spp)
+			return true;
+		return p.error() <= fmax(settings.relative_error * p.mean, tolerance);
+	}
+
+	// called between the min_spp pass and the adaptive pass
+	void update_tolerance()
+	{
+		double mean = 0;
+		for (const auto& p : pixels)
+			mean += p.mean;
+		mean /= pixels.size();
+		tolerance = settings.global_error * mean;
+	}
+
+	long long total_samples() const
+	{
+		long long total = 0;
+		for (const auto& p : pixels)
+			total += p.n;
+		return total;
+	}
+
+	// spp map as a binary greyscale PGM, white = max_spp
+	bool write_spp_map(const string& filename) const;
+};
+
+bool adaptive_sampler::write_spp_map(const string& filename) const
+{
+	ofstream out(filename, ios::binary);
+	if (!out)
+		return false;
+
+	out << "P5\n" << image_width << ' ' << image_height << "\n255\n";
+	for (int j = image_height - 1; j >= 0; --j)
+	{
+		for (int i = 0; i < image_width; ++i)
+		{
+			auto n = pixels[size_t(j) * image_width + i].n;
+			out.put(static_cast<char>(255 * n / settings.max_spp));
+		}
+	}
+	return bool(out);
+}
+#endif // !ADAPTIVE_SAMPLER_H
@@ -23,8 +23,18 @@ public:
     
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
     {
+        // the box test is much cheaper than six rectangle tests and rejects most rays
+        if (!aabb(box_min, box_max).hit(r, t_min, t_max))
+            return false;
         return sides.hit(r, t_min, t_max, rec);
     }
+
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override
+    {
+        if (!aabb(box_min, box_max).hit(r, t_min, t_max))
+            return false;
+        return sides.occluded(r, t_min, t_max);
+    }
     
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
     {
@@ -5,31 +5,1443 @@
 #include "ray.h"
 #include "hittable_list.h"
 #include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include "utils.h"
 
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis)
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Bounds of one primitive, gathered once before a build so the builder never has to
+// call bounding_box() again.
+struct bvh_primitive
+{
+	aabb box;
+	point3 centroid;
+	size_t index; // position in the source object list
+};
+
+inline vector<bvh_primitive> gather_primitives(const vector<shared_ptr<hittable>>& objects, size_t start, size_t end, double time0, double time1)
+{
+	vector<bvh_primitive> prims(end - start);
+	for (size_t n = start; n < end; ++n)
+	{
+		auto& p = prims[n - start];
+		if (!objects[n]->bounding_box(time0, time1, p.box))
+			cerr << "No bounding box in bvh_node constructor.\n";
+		p.centroid = p.box.centroid();
+		p.index = n;
+	}
+	return prims;
+}
+
+struct bvh_build_node
+{
+	aabb box;
+	int axis = 0;     // split axis of an interior node
+	size_t first = 0; // leaf: primitives [first, first + count) in the builder's order
+	size_t count = 0; // 0 for interior nodes
+	unique_ptr<bvh_build_node> children[2];
+
+	bool is_leaf() const { return count > 0; }
+};
+
+enum class bvh_builder_type
+{
+	sah,  // binned SAH, best trees
+	lbvh, // Morton code linear BVH, fastest builds
+	sbvh  // SAH with spatial splits, for large or long overlapping primitives
+};
+
+inline const char* bvh_builder_name(bvh_builder_type type)
+{
+	switch (type)
+	{
+	case bvh_builder_type::sah: return "sah";
+	case bvh_builder_type::lbvh: return "lbvh";
+	case bvh_builder_type::sbvh: return "sbvh";
+	}
+	return "?";
+}
+
+inline bool parse_bvh_builder(const string& name, bvh_builder_type& type)
+{
+	for (auto t : { bvh_builder_type::sah, bvh_builder_type::lbvh, bvh_builder_type::sbvh })
+	{
+		if (name == bvh_builder_name(t))
+		{
+			type = t;
+			return true;
+		}
+	}
+	return false;
+}
+
+// What the treelet pass did to one tree, see treelet_optimizer.
+struct treelet_result
+{
+	double sah_before = 0; // relative to one primitive test
+	double sah_after = 0;
+	double milliseconds = 0;
+};
+
+// treelet_results summed over every tree built with the same settings, e.g. the segments
+// of a motion_bvh. Trees are built one after another, so adding needs no lock.
+struct treelet_totals
+{
+	int trees = 0;
+	double sah_before = 0; // sums; divide by trees for the average
+	double sah_after = 0;
+	double milliseconds = 0;
+
+	void add(const treelet_result& r)
+	{
+		++trees;
+		sah_before += r.sah_before;
+		sah_after += r.sah_after;
+		milliseconds += r.milliseconds;
+	}
+};
+
+struct bvh_build_settings
+{
+	bvh_builder_type builder = bvh_builder_type::sah;
+	int bins = 16;
+	size_t max_leaf_size = 4;
+	double traversal_cost = 1.0;      // cost of visiting a node, relative to one primitive test
+	size_t parallel_threshold = 4096; // larger ranges build their two halves concurrently
+	int max_depth = 64;               // deeper ranges are halved at the median, which bounds the tree depth
+	int morton_bits = 30;             // lbvh: 30 or 63 bit codes
+	size_t sah_clusters = 0;          // lbvh: rebuild the top of the tree over this many subtrees with the SAH, 0 to skip
+	double spatial_split_alpha = 1e-5; // sbvh: try spatial splits when the children overlap by more than this fraction of the root area
+	double max_duplication = 0.5;      // sbvh: at most this many extra references per primitive, on average
+	int treelet_passes = 0;           // restructure treelets after any builder this many times, 0 to skip
+	int treelet_size = 7;             // leaves per treelet, up to 8
+	treelet_totals* treelet_report = nullptr; // if set, every build_bvh() with these settings adds its treelet result here
+};
+
+// traversal stacks hold one entry per level; max_depth plus the halving of up to 2^32 primitives fits
+const int bvh_stack_size = 128;
+
+// Counters a traversal can be handed. The default no_traversal_stats compiles to nothing,
+// so the renderer's traversals are unchanged.
+struct no_traversal_stats
+{
+	void visit_node() {}
+	void test_primitive() {}
+};
+
+struct traversal_stats
+{
+	uint64_t rays = 0;
+	uint64_t nodes = 0;      // nodes whose boxes were tested; a wide node tests all its children at once
+	uint64_t primitives = 0; // primitive tests in leaves
+
+	void visit_node() { ++nodes; }
+	void test_primitive() { ++primitives; }
+};
+
+// Binned surface area heuristic builder. Primitives are reordered in place and
+// leaves refer to ranges of that order.
+class sah_builder
+{
+public:
+	bvh_build_settings settings;
+	vector<bvh_primitive>& prims;
+
+	sah_builder(vector<bvh_primitive>& p, const bvh_build_settings& s = bvh_build_settings()) : settings(s), prims(p) {}
+
+	unique_ptr<bvh_build_node> build();
+
+	void range_bounds(size_t start, size_t end, aabb& bounds, aabb& centroid_bounds) const;
+
+	// Partitions [start, end) at the cheapest of the binned split planes and returns the
+	// split position, or start if a leaf is cheaper than any split.
+	size_t split(size_t start, size_t end, const aabb& bounds, const aabb& centroid_bounds, int& axis);
+
+	// object median along the widest centroid axis
+	size_t median_split(size_t start, size_t end, const aabb& centroid_bounds, int& axis);
+
+private:
+	unique_ptr<bvh_build_node> build_range(size_t start, size_t end, int depth, int parallel_depth);
+};
+
+unique_ptr<bvh_build_node> sah_builder::build()
+{
+	// enough concurrent subtrees to keep every core busy, with some slack for imbalance
+	int parallel_depth = 2;
+	for (unsigned n = thread::hardware_concurrency(); n > 1; n >>= 1)
+		++parallel_depth;
+
+	return build_range(0, prims.size(), 0, parallel_depth);
+}
+
+void sah_builder::range_bounds(size_t start, size_t end, aabb& bounds, aabb& centroid_bounds) const
+{
+	bounds = prims[start].box;
+	centroid_bounds = aabb(prims[start].centroid, prims[start].centroid);
+	for (size_t n = start + 1; n < end; ++n)
+	{
+		bounds = surrounding_box(bounds, prims[n].box);
+		centroid_bounds = surrounding_box(centroid_bounds, aabb(prims[n].centroid, prims[n].centroid));
+	}
+}
+
+size_t sah_builder::split(size_t start, size_t end, const aabb& bounds, const aabb& centroid_bounds, int& axis)
+{
+	struct bin
+	{
+		aabb box;
+		size_t count = 0;
+	};
+
+	const int bin_count = settings.bins;
+	size_t count = end - start;
+	double parent_area = bounds.surface_area();
+
+	double best_cost = infinity;
+	int best_axis = -1;
+	int best_bin = 0;
+
+	vector<bin> bins(bin_count);
+	vector<double> right_cost(bin_count);
+
+	for (int a = 0; a < 3; ++a)
+	{
+		double lo = centroid_bounds.min()[a];
+		double extent = centroid_bounds.max()[a] - lo;
+		if (extent <= 0)
+			continue;
+
+		for (auto& b : bins)
+			b.count = 0;
+
+		for (size_t n = start; n < end; ++n)
+		{
+			int k = min(int(bin_count * (prims[n].centroid[a] - lo) / extent), bin_count - 1);
+			bins[k].box = bins[k].count ? surrounding_box(bins[k].box, prims[n].box) : prims[n].box;
+			++bins[k].count;
+		}
+
+		// sweep from the right to get the cost of everything at or after bin k,
+		// then from the left to evaluate the plane before bin k
+		aabb box;
+		size_t side = 0;
+		for (int k = bin_count - 1; k > 0; --k)
+		{
+			if (bins[k].count)
+			{
+				box = side ? surrounding_box(box, bins[k].box) : bins[k].box;
+				side += bins[k].count;
+			}
+			right_cost[k] = side ? side * box.surface_area() : 0;
+		}
+
+		side = 0;
+		for (int k = 1; k < bin_count; ++k)
+		{
+			if (bins[k - 1].count)
+			{
+				box = side ? surrounding_box(box, bins[k - 1].box) : bins[k - 1].box;
+				side += bins[k - 1].count;
+			}
+			if (side == 0 || side == count)
+				continue;
+
+			double cost = settings.traversal_cost + (side * box.surface_area() + right_cost[k]) / (parent_area > 0 ? parent_area : 1);
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = a;
+				best_bin = k;
+			}
+		}
+	}
+
+	if (count <= settings.max_leaf_size && (best_axis < 0 || best_cost >= count))
+		return start;
+
+	auto first = prims.begin() + start;
+	auto last = prims.begin() + end;
+	size_t mid = start + count / 2;
+
+	if (best_axis < 0)
+	{
+		// every centroid coincides: no plane separates them, split the range in half
+		axis = 0;
+		return mid;
+	}
+
+	axis = best_axis;
+	double lo = centroid_bounds.min()[axis];
+	double extent = centroid_bounds.max()[axis] - lo;
+	auto it = partition(first, last, [&](const bvh_primitive& p)
+	{
+		return min(int(bin_count * (p.centroid[axis] - lo) / extent), bin_count - 1) < best_bin;
+	});
+	return size_t(it - prims.begin());
+}
+
+size_t sah_builder::median_split(size_t start, size_t end, const aabb& centroid_bounds, int& axis)
+{
+	auto extent = centroid_bounds.max() - centroid_bounds.min();
+	axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+
+	size_t mid = start + (end - start) / 2;
+	int a = axis;
+	nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end, [a](const bvh_primitive& p, const bvh_primitive& q)
+	{
+		return p.centroid[a] < q.centroid[a];
+	});
+	return mid;
+}
+
+unique_ptr<bvh_build_node> sah_builder::build_range(size_t start, size_t end, int depth, int parallel_depth)
+{
+	auto node = make_unique<bvh_build_node>();
+
+	aabb centroid_bounds;
+	range_bounds(start, end, node->box, centroid_bounds);
+
+	size_t mid;
+	if (depth < settings.max_depth || end - start <= settings.max_leaf_size)
+		mid = split(start, end, node->box, centroid_bounds, node->axis);
+	else
+		mid = median_split(start, end, centroid_bounds, node->axis);
+
+	if (mid == start)
+	{
+		node->first = start;
+		node->count = end - start;
+		return node;
+	}
+
+	if (parallel_depth > 0 && end - start > settings.parallel_threshold)
+	{
+		auto left = async(launch::async, [=] { return build_range(start, mid, depth + 1, parallel_depth - 1); });
+		node->children[1] = build_range(mid, end, depth + 1, parallel_depth - 1);
+		node->children[0] = left.get();
+	}
+	else
+	{
+		node->children[0] = build_range(start, mid, depth + 1, parallel_depth);
+		node->children[1] = build_range(mid, end, depth + 1, parallel_depth);
+	}
+	return node;
+}
+
+// Splits [0, count) into chunks ranges and runs body(chunk, begin, end) for each on its
+// own thread. The split only depends on count and chunks, so passes over the same data
+// see the same ranges.
+template<typename body_fn>
+void parallel_chunks(size_t count, size_t chunks, body_fn body)
+{
+	vector<future<void>> running;
+	for (size_t c = 1; c < chunks; ++c)
+		running.push_back(async(launch::async, [=, &body] { body(c, count * c / chunks, count * (c + 1) / chunks); }));
+	body(0, 0, count / chunks);
+	for (auto& r : running)
+		r.get();
+}
+
+// one chunk per core, but no chunk smaller than min_size
+inline size_t parallel_chunk_count(size_t count, size_t min_size = 16384)
+{
+	size_t cores = max(1u, thread::hardware_concurrency());
+	return max<size_t>(1, min(cores, count / min_size));
+}
+
+inline int count_leading_zeros(uint64_t x)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	if (_BitScanReverse(&index, (unsigned long)(x >> 32)))
+		return 31 - int(index);
+	return _BitScanReverse(&index, (unsigned long)x) ? 63 - int(index) : 64;
+#else
+	return x ? __builtin_clzll(x) : 64;
+#endif
+}
+
+// spread the low 10 bits of x so two zero bits follow each of them
+inline uint64_t expand_bits_10(uint64_t x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x30000ff;
+	x = (x | (x << 8)) & 0x300f00f;
+	x = (x | (x << 4)) & 0x30c30c3;
+	x = (x | (x << 2)) & 0x9249249;
+	return x;
+}
+
+// spread the low 21 bits of x the same way
+inline uint64_t expand_bits_21(uint64_t x)
+{
+	x &= 0x1fffff;
+	x = (x | (x << 32)) & 0x1f00000000ffffull;
+	x = (x | (x << 16)) & 0x1f0000ff0000ffull;
+	x = (x | (x << 8)) & 0x100f00f00f00f00full;
+	x = (x | (x << 4)) & 0x10c30c30c30c30c3ull;
+	x = (x | (x << 2)) & 0x1249249249249249ull;
+	return x;
+}
+
+// Morton code of p inside bounds, x in the highest bit of every triple. bits is 30 or 63.
+inline uint64_t morton_code(const point3& p, const aabb& bounds, int bits)
+{
+	const double cells = bits > 30 ? 2097152.0 : 1024.0;
+	uint64_t q[3];
+	for (int a = 0; a < 3; ++a)
+	{
+		double extent = bounds.max()[a] - bounds.min()[a];
+		double x = extent > 0 ? (p[a] - bounds.min()[a]) / extent * cells : 0;
+		q[a] = uint64_t(clamp(x, 0.0, cells - 1));
+	}
+	if (bits > 30)
+		return (expand_bits_21(q[0]) << 2) | (expand_bits_21(q[1]) << 1) | expand_bits_21(q[2]);
+	return (expand_bits_10(q[0]) << 2) | (expand_bits_10(q[1]) << 1) | expand_bits_10(q[2]);
+}
+
+struct morton_primitive
+{
+	uint64_t code;
+	uint32_t index; // position in the primitive array before sorting
+};
+
+// LSD radix sort on the low bits of the codes, 8 bits per pass. Every chunk counts its
+// digits, a prefix sum over (digit, chunk) hands each chunk its own output ranges, and
+// the chunks scatter concurrently. The sort is stable.
+inline void radix_sort(vector<morton_primitive>& items, int bits)
+{
+	size_t n = items.size();
+	size_t chunks = parallel_chunk_count(n);
+	vector<morton_primitive> sorted(n);
+	vector<size_t> offsets(chunks * 256);
+
+	for (int shift = 0; shift < bits; shift += 8)
+	{
+		parallel_chunks(n, chunks, [&](size_t c, size_t begin, size_t end)
+		{
+			size_t* count = &offsets[c * 256];
+			fill(count, count + 256, 0);
+			for (size_t k = begin; k < end; ++k)
+				++count[(items[k].code >> shift) & 255];
+		});
+
+		size_t sum = 0;
+		for (int d = 0; d < 256; ++d)
+		{
+			for (size_t c = 0; c < chunks; ++c)
+			{
+				size_t count = offsets[c * 256 + d];
+				offsets[c * 256 + d] = sum;
+				sum += count;
+			}
+		}
+
+		parallel_chunks(n, chunks, [&](size_t c, size_t begin, size_t end)
+		{
+			size_t* offset = &offsets[c * 256];
+			for (size_t k = begin; k < end; ++k)
+				sorted[offset[(items[k].code >> shift) & 255]++] = items[k];
+		});
+		items.swap(sorted);
+	}
+}
+
+// Linear BVH builder (Karras 2012). Primitives are sorted along a Morton curve, and every
+// internal node of the binary radix tree over the sorted codes is found from the codes
+// alone, so all of them are emitted in one parallel pass. Builds an order of magnitude
+// faster than sah_builder but the trees trace slower; settings.sah_clusters rebuilds the
+// top of the tree with the SAH to win part of that back. Primitives are reordered in place.
+class lbvh_builder
+{
+public:
+	bvh_build_settings settings;
+	vector<bvh_primitive>& prims;
+
+	lbvh_builder(vector<bvh_primitive>& p, const bvh_build_settings& s = bvh_build_settings()) : settings(s), prims(p) {}
+
+	unique_ptr<bvh_build_node> build();
+
+private:
+	// internal node of the radix tree, covering the sorted primitives [first, last]
+	struct radix_node
+	{
+		uint32_t first;
+		uint32_t last;
+		uint32_t split; // the left child ends at split; children at or below one primitive are leaves
+		int axis;
+	};
+
+	vector<uint64_t> codes;
+	vector<radix_node> nodes;
+
+	int prefix(int64_t i, int64_t j) const;
+	void emit_radix_node(size_t i);
+	unique_ptr<bvh_build_node> emit(uint32_t first, uint32_t last, uint32_t node, int parallel_depth) const;
+	unique_ptr<bvh_build_node> refine_top(unique_ptr<bvh_build_node> root) const;
+};
+
+unique_ptr<bvh_build_node> lbvh_builder::build()
+{
+	size_t n = prims.size();
+	size_t chunks = parallel_chunk_count(n);
+	int bits = settings.morton_bits > 30 ? 63 : 30;
+
+	// centroid bounds, reduced per chunk
+	vector<aabb> chunk_bounds(chunks);
+	parallel_chunks(n, chunks, [&](size_t c, size_t begin, size_t end)
+	{
+		aabb b(prims[begin].centroid, prims[begin].centroid);
+		for (size_t k = begin + 1; k < end; ++k)
+			b = surrounding_box(b, aabb(prims[k].centroid, prims[k].centroid));
+		chunk_bounds[c] = b;
+	});
+	aabb centroid_bounds = chunk_bounds[0];
+	for (size_t c = 1; c < chunks; ++c)
+		centroid_bounds = surrounding_box(centroid_bounds, chunk_bounds[c]);
+
+	vector<morton_primitive> items(n);
+	parallel_chunks(n, chunks, [&](size_t c, size_t begin, size_t end)
+	{
+		for (size_t k = begin; k < end; ++k)
+			items[k] = morton_primitive{ morton_code(prims[k].centroid, centroid_bounds, bits), uint32_t(k) };
+	});
+	radix_sort(items, bits);
+
+	vector<bvh_primitive> sorted(n);
+	codes.resize(n);
+	parallel_chunks(n, chunks, [&](size_t c, size_t begin, size_t end)
+	{
+		for (size_t k = begin; k < end; ++k)
+		{
+			sorted[k] = prims[items[k].index];
+			codes[k] = items[k].code;
+		}
+	});
+	prims.swap(sorted);
+
+	// n - 1 internal nodes, each one independent of the others
+	nodes.resize(n > 1 ? n - 1 : 0);
+	parallel_chunks(nodes.size(), parallel_chunk_count(nodes.size()), [&](size_t c, size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+			emit_radix_node(i);
+	});
+
+	int parallel_depth = 2;
+	for (unsigned t = thread::hardware_concurrency(); t > 1; t >>= 1)
+		++parallel_depth;
+
+	auto root = emit(0, uint32_t(n - 1), 0, parallel_depth);
+	codes.clear();
+	nodes.clear();
+
+	if (settings.sah_clusters > 1 && n > settings.sah_clusters)
+		root = refine_top(move(root));
+	return root;
+}
+
+// length of the common prefix of the codes at i and j, -1 outside the array; equal codes
+// are told apart by their positions
+int lbvh_builder::prefix(int64_t i, int64_t j) const
+{
+	if (j < 0 || j >= int64_t(codes.size()))
+		return -1;
+	if (codes[i] == codes[j])
+		return 64 + count_leading_zeros(uint64_t(i ^ j));
+	return count_leading_zeros(codes[i] ^ codes[j]);
+}
+
+void lbvh_builder::emit_radix_node(size_t index)
+{
+	int64_t i = int64_t(index);
+
+	// the node extends towards the neighbour sharing the longer prefix
+	int d = prefix(i, i + 1) > prefix(i, i - 1) ? 1 : -1;
+	int min_prefix = prefix(i, i - d);
+
+	int64_t max_length = 2;
+	while (prefix(i, i + max_length * d) > min_prefix)
+		max_length *= 2;
+
+	int64_t length = 0;
+	for (int64_t t = max_length / 2; t >= 1; t /= 2)
+	{
+		if (prefix(i, i + (length + t) * d) > min_prefix)
+			length += t;
+	}
+	int64_t j = i + length * d;
+
+	// binary search for the last position sharing more than the node's prefix
+	int node_prefix = prefix(i, j);
+	int64_t step = 0;
+	for (int64_t div = 2, t = (length + 1) / 2; ; div *= 2, t = (length + div - 1) / div)
+	{
+		if (prefix(i, i + (step + t) * d) > node_prefix)
+			step += t;
+		if (t == 1)
+			break;
+	}
+	int64_t split = i + step * d + min(d, 0);
+
+	// the highest differing bit names the axis that was split
+	int axis = 0;
+	if (node_prefix < 64)
+		axis = 2 - (63 - node_prefix) % 3;
+
+	nodes[index] = radix_node{ uint32_t(min(i, j)), uint32_t(max(i, j)), uint32_t(split), axis };
+}
+
+unique_ptr<bvh_build_node> lbvh_builder::emit(uint32_t first, uint32_t last, uint32_t node, int parallel_depth) const
+{
+	auto out = make_unique<bvh_build_node>();
+	size_t count = size_t(last) - first + 1;
+
+	if (count <= settings.max_leaf_size)
+	{
+		out->first = first;
+		out->count = count;
+		out->box = prims[first].box;
+		for (size_t k = first + 1; k <= last; ++k)
+			out->box = surrounding_box(out->box, prims[k].box);
+		return out;
+	}
+
+	const radix_node& r = nodes[node];
+	out->axis = r.axis;
+
+	// the left child of node i is internal node split, the right one split + 1
+	if (parallel_depth > 0 && count > settings.parallel_threshold)
+	{
+		auto left = async(launch::async, [&] { return emit(first, r.split, r.split, parallel_depth - 1); });
+		out->children[1] = emit(r.split + 1, last, r.split + 1, parallel_depth - 1);
+		out->children[0] = left.get();
+	}
+	else
+	{
+		out->children[0] = emit(first, r.split, r.split, parallel_depth);
+		out->children[1] = emit(r.split + 1, last, r.split + 1, parallel_depth);
+	}
+	out->box = surrounding_box(out->children[0]->box, out->children[1]->box);
+	return out;
+}
+
+// Cuts the tree into subtrees of at most n / sah_clusters primitives and builds the levels
+// above them again with the SAH, treating every subtree as a single primitive.
+unique_ptr<bvh_build_node> lbvh_builder::refine_top(unique_ptr<bvh_build_node> root) const
+{
+	size_t cluster_size = max<size_t>(1, prims.size() / settings.sah_clusters);
+	vector<unique_ptr<bvh_build_node>> clusters;
+
+	vector<unique_ptr<bvh_build_node>> open;
+	open.push_back(move(root));
+	while (!open.empty())
+	{
+		auto node = move(open.back());
+		open.pop_back();
+
+		size_t count = node->count;
+		if (!node->is_leaf())
+		{
+			// subtree sizes are not stored, but the leaves of every subtree are contiguous
+			const bvh_build_node* lo = node.get();
+			const bvh_build_node* hi = node.get();
+			while (!lo->is_leaf())
+				lo = lo->children[0].get();
+			while (!hi->is_leaf())
+				hi = hi->children[1].get();
+			count = hi->first + hi->count - lo->first;
+		}
+
+		if (count > cluster_size)
+		{
+			open.push_back(move(node->children[0]));
+			open.push_back(move(node->children[1]));
+		}
+		else
+			clusters.push_back(move(node));
+	}
+
+	vector<bvh_primitive> cluster_prims(clusters.size());
+	for (size_t k = 0; k < clusters.size(); ++k)
+		cluster_prims[k] = bvh_primitive{ clusters[k]->box, clusters[k]->box.centroid(), k };
+
+	bvh_build_settings top_settings = settings;
+	top_settings.max_leaf_size = 1;
+	auto top = sah_builder(cluster_prims, top_settings).build();
+
+	// every leaf of the top tree holds one cluster; put the subtree in its place
+	vector<unique_ptr<bvh_build_node>*> pending = { &top };
+	while (!pending.empty())
+	{
+		auto slot = pending.back();
+		pending.pop_back();
+		if ((*slot)->is_leaf())
+			*slot = move(clusters[cluster_prims[(*slot)->first].index]);
+		else
+		{
+			pending.push_back(&(*slot)->children[0]);
+			pending.push_back(&(*slot)->children[1]);
+		}
+	}
+	return top;
+}
+
+// Treelet restructuring (Karras and Aila 2013), a post pass that improves any build tree.
+// Bottom-up, every node with enough primitives below it is made the root of a treelet:
+// its descendants are expanded, largest area first, until the treelet has treelet_size
+// leaves, which may be whole subtrees. Dynamic programming over all subsets of those
+// leaves then finds the topology with the lowest SAH cost, and the treelet's interior
+// nodes are rewired to it. A subset of up to max_leaf_size primitives may also become a
+// single leaf, so a tree built with one primitive per leaf gets SAH-chosen leaves; the
+// primitives are reordered at the end to keep every leaf a contiguous range.
+class treelet_optimizer
+{
+public:
+	bvh_build_settings settings;
+
+	explicit treelet_optimizer(const bvh_build_settings& s = bvh_build_settings()) : settings(s) {}
+
+	using result = treelet_result;
+
+	// runs settings.treelet_passes passes over the tree built over prims
+	result optimize(bvh_build_node& root, vector<bvh_primitive>& prims);
+
+private:
+	static const int max_treelet_size = 8;
+
+	struct subtree
+	{
+		double cost = 0;  // unnormalized SAH cost, area times cost per node and primitive
+		size_t count = 0; // primitives
+		int height = 0;
+	};
+
+	// One entry per interior node, filled before every pass; an interior node keeps its
+	// index in first, which only leaves use otherwise. Nodes are rewired but never created
+	// during a pass, so the threads only update existing entries. A collapsed node gets
+	// its leaf count but keeps its children and index until lay_out().
+	vector<subtree> info;
+
+	subtree get(const bvh_build_node& node) const
+	{
+		if (!node.is_leaf())
+			return info[node.first];
+		subtree s;
+		s.cost = node.box.surface_area() * node.count;
+		s.count = node.count;
+		return s;
+	}
+
+	subtree measure(bvh_build_node& node);
+	void optimize_node(bvh_build_node& node, int depth, int parallel_depth);
+	void restructure(bvh_build_node& root, int depth);
+	void lay_out(bvh_build_node& node, const vector<bvh_primitive>& prims, vector<bvh_primitive>& ordered) const;
+	void gather(const bvh_build_node& node, const vector<bvh_primitive>& prims, vector<bvh_primitive>& ordered) const;
+};
+
+treelet_optimizer::result treelet_optimizer::optimize(bvh_build_node& root, vector<bvh_primitive>& prims)
 {
-	aabb box_a;
-	aabb box_b;
+	auto start = chrono::steady_clock::now();
+	int parallel_depth = 2;
+	for (unsigned n = thread::hardware_concurrency(); n > 1; n >>= 1)
+		++parallel_depth;
 
-	if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
-		cerr << "No bounding box in bvh_node constructor.\n";
-	return box_a.min().e[axis] < box_b.min().e[axis];
+	double root_area = root.box.surface_area();
+	double scale = root_area > 0 ? 1 / root_area : 1;
+
+	result r;
+	for (int pass = 0; pass < settings.treelet_passes; ++pass)
+	{
+		info.clear();
+		double cost = measure(root).cost;
+		if (pass == 0)
+			r.sah_before = cost * scale;
+		optimize_node(root, 0, parallel_depth);
+	}
+	r.sah_after = get(root).cost * scale;
+	info.clear();
+
+	vector<bvh_primitive> ordered;
+	ordered.reserve(prims.size());
+	lay_out(root, prims, ordered);
+	prims.swap(ordered);
+	r.milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	return r;
 }
 
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+treelet_optimizer::subtree treelet_optimizer::measure(bvh_build_node& node)
 {
-	return box_compare(a, b, 0);
+	if (node.is_leaf())
+		return get(node);
+
+	subtree left = measure(*node.children[0]);
+	subtree right = measure(*node.children[1]);
+	subtree s;
+	s.cost = node.box.surface_area() * settings.traversal_cost + left.cost + right.cost;
+	s.count = left.count + right.count;
+	s.height = max(left.height, right.height) + 1;
+	node.first = info.size();
+	info.push_back(s);
+	return s;
 }
 
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+void treelet_optimizer::optimize_node(bvh_build_node& node, int depth, int parallel_depth)
 {
-	return box_compare(a, b, 1);
+	if (node.is_leaf())
+		return;
+
+	if (parallel_depth > 0 && info[node.first].count > settings.parallel_threshold)
+	{
+		auto left = async(launch::async, [&] { optimize_node(*node.children[0], depth + 1, parallel_depth - 1); });
+		optimize_node(*node.children[1], depth + 1, parallel_depth - 1);
+		left.get();
+	}
+	else
+	{
+		optimize_node(*node.children[0], depth + 1, parallel_depth);
+		optimize_node(*node.children[1], depth + 1, parallel_depth);
+	}
+
+	// smaller subtrees have little to gain, and skipping them bounds the work
+	if (info[node.first].count >= size_t(settings.treelet_size))
+		restructure(node, depth);
 }
 
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+void treelet_optimizer::restructure(bvh_build_node& root, int depth)
 {
-	return box_compare(a, b, 2);
+	int size = settings.treelet_size < 3 ? 3 : (settings.treelet_size > max_treelet_size ? max_treelet_size : settings.treelet_size);
+
+	// grow the treelet by expanding its largest interior leaf
+	bvh_build_node* leaves[max_treelet_size] = { root.children[0].get(), root.children[1].get() };
+	bvh_build_node* interior[max_treelet_size] = { &root };
+	int leaf_count = 2;
+	int interior_count = 1;
+	while (leaf_count < size)
+	{
+		int widest = -1;
+		for (int k = 0; k < leaf_count; ++k)
+		{
+			if (!leaves[k]->is_leaf() && (widest < 0 || leaves[k]->box.surface_area() > leaves[widest]->box.surface_area()))
+				widest = k;
+		}
+		if (widest < 0)
+			break;
+		bvh_build_node* opened = leaves[widest];
+		interior[interior_count++] = opened;
+		leaves[widest] = opened->children[0].get();
+		leaves[leaf_count++] = opened->children[1].get();
+	}
+	if (leaf_count < 3)
+		return;
+
+	// best[s]: cheapest cost and height of a subtree over the leaves in bit set s, and the
+	// subset that goes to its first child
+	const int sets = 1 << leaf_count;
+	double area[1 << max_treelet_size];
+	size_t count[1 << max_treelet_size];
+	double best[1 << max_treelet_size];
+	int height[1 << max_treelet_size];
+	int first[1 << max_treelet_size];
+	bool collapse[1 << max_treelet_size];
+	aabb boxes[1 << max_treelet_size];
+	subtree leaf_info[max_treelet_size];
+	for (int k = 0; k < leaf_count; ++k)
+		leaf_info[k] = get(*leaves[k]);
+	for (int s = 1; s < sets; ++s)
+	{
+		// s without its lowest leaf was done before s
+		int rest = s & (s - 1);
+		int k = 0;
+		while (!(s & (1 << k)))
+			++k;
+		boxes[s] = rest ? surrounding_box(boxes[rest], leaves[k]->box) : leaves[k]->box;
+		count[s] = (rest ? count[rest] : 0) + leaf_info[k].count;
+		area[s] = boxes[s].surface_area();
+	}
+
+	// a leaf over everything in s, if that is allowed and cheaper than best[s]
+	auto try_collapse = [&](int s)
+	{
+		collapse[s] = count[s] <= settings.max_leaf_size && area[s] * count[s] < best[s];
+		if (collapse[s])
+		{
+			best[s] = area[s] * count[s];
+			height[s] = 0;
+		}
+	};
+
+	for (int k = 0; k < leaf_count; ++k)
+	{
+		best[1 << k] = leaf_info[k].cost;
+		height[1 << k] = leaf_info[k].height;
+		collapse[1 << k] = false;
+		if (!leaves[k]->is_leaf())
+			try_collapse(1 << k);
+	}
+
+	// every proper subset of s is a smaller number, so increasing order solves them first
+	for (int s = 1; s < sets; ++s)
+	{
+		if ((s & (s - 1)) == 0)
+			continue;
+
+		// each split once: the first child holds the lowest leaf of s and a proper subset
+		// of the others
+		int lowest = s & -s;
+		int others = s ^ lowest;
+		best[s] = infinity;
+		for (int q = (others - 1) & others; ; q = (q - 1) & others)
+		{
+			int p = q | lowest;
+			double cost = best[p] + best[s ^ p];
+			if (cost < best[s])
+			{
+				best[s] = cost;
+				first[s] = p;
+			}
+			if (q == 0)
+				break;
+		}
+		height[s] = max(height[first[s]], height[s ^ first[s]]) + 1;
+		best[s] += area[s] * settings.traversal_cost;
+		try_collapse(s);
+	}
+
+	if (best[sets - 1] >= info[root.first].cost * (1 - 1e-9) || depth + height[sets - 1] >= bvh_stack_size - 1)
+		return;
+
+	// take the treelet apart, then rewire its interior nodes, the root first
+	for (int k = 0; k < interior_count; ++k)
+	{
+		interior[k]->children[0].release();
+		interior[k]->children[1].release();
+	}
+
+	int next_interior = 0;
+	function<bvh_build_node*(int)> rebuild = [&](int s) -> bvh_build_node*
+	{
+		if ((s & (s - 1)) == 0)
+		{
+			int k = 0;
+			while (!(s & (1 << k)))
+				++k;
+			if (collapse[s])
+				leaves[k]->count = count[s];
+			return leaves[k];
+		}
+
+		bvh_build_node* node = interior[next_interior++];
+		bvh_build_node* a = rebuild(first[s]);
+		bvh_build_node* b = rebuild(s ^ first[s]);
+		node->box = surrounding_box(a->box, b->box);
+
+		// split along the axis that separates the children most, lower child first
+		point3 d = b->box.centroid() - a->box.centroid();
+		node->axis = fabs(d.x()) > fabs(d.y()) ? (fabs(d.x()) > fabs(d.z()) ? 0 : 2) : (fabs(d.y()) > fabs(d.z()) ? 1 : 2);
+		if (d[node->axis] < 0)
+			swap(a, b);
+		node->children[0].reset(a);
+		node->children[1].reset(b);
+		node->count = collapse[s] ? count[s] : 0;
+		if (!collapse[s])
+		{
+			subtree& node_info = info[node->first];
+			node_info.cost = best[s];
+			node_info.count = count[s];
+			node_info.height = height[s];
+		}
+
+		return node;
+	};
+	rebuild(sets - 1);
+}
+
+// Copies the primitives to ordered leaf by leaf, giving every leaf, collapsed ones
+// included, a contiguous range again.
+void treelet_optimizer::lay_out(bvh_build_node& node, const vector<bvh_primitive>& prims, vector<bvh_primitive>& ordered) const
+{
+	if (!node.is_leaf())
+	{
+		node.first = 0;
+		lay_out(*node.children[0], prims, ordered);
+		lay_out(*node.children[1], prims, ordered);
+		return;
+	}
+
+	size_t first = ordered.size();
+	gather(node, prims, ordered);
+	node.first = first;
+	node.count = ordered.size() - first;
+	node.children[0].reset();
+	node.children[1].reset();
+}
+
+void treelet_optimizer::gather(const bvh_build_node& node, const vector<bvh_primitive>& prims, vector<bvh_primitive>& ordered) const
+{
+	if (node.children[0])
+	{
+		gather(*node.children[0], prims, ordered);
+		gather(*node.children[1], prims, ordered);
+	}
+	else
+		ordered.insert(ordered.end(), prims.begin() + node.first, prims.begin() + node.first + node.count);
+}
+
+// box cut to lo <= x[axis] <= hi, and never inverted
+inline aabb clip_box(const aabb& box, int axis, double lo, double hi)
+{
+	point3 a = box.min();
+	point3 b = box.max();
+	a[axis] = fmin(fmax(a[axis], lo), b[axis]);
+	b[axis] = fmax(fmin(b[axis], hi), a[axis]);
+	return aabb(a, b);
+}
+
+inline double overlap_area(const aabb& a, const aabb& b)
+{
+	point3 lo, hi;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		lo[axis] = fmax(a.min()[axis], b.min()[axis]);
+		hi[axis] = fmin(a.max()[axis], b.max()[axis]);
+		if (hi[axis] < lo[axis])
+			return 0;
+	}
+	return aabb(lo, hi).surface_area();
+}
+
+// Spatial split BVH (Stich et al. 2009). Builds like sah_builder, but where the children
+// of the best object split overlap, as they do around walls and long thin primitives, it
+// also cuts the node at binned planes and splits the references straddling the plane, so
+// each child only bounds its side of them. A primitive can end up in several leaves:
+// prims gets one entry per reference, carrying the index of its primitive. Only boxes
+// are clipped, which is exact for the axis-aligned rects and conservative otherwise.
+class sbvh_builder
+{
+public:
+	bvh_build_settings settings;
+	vector<bvh_primitive>& prims;
+
+	sbvh_builder(vector<bvh_primitive>& p, const bvh_build_settings& s = bvh_build_settings()) : settings(s), prims(p) {}
+
+	// replaces prims with the references in leaf order
+	unique_ptr<bvh_build_node> build();
+
+private:
+	struct split_choice
+	{
+		double cost = infinity;
+		int axis = -1;
+		int bin = 0;
+		aabb left, right; // bounds of the two children
+	};
+
+	double root_area = 0;
+	mutex leaves_mutex;
+	vector<vector<bvh_primitive>> leaves; // while building, a leaf's first is its position here
+
+	int bin_of(double x, double lo, double extent) const
+	{
+		int k = int(settings.bins * (x - lo) / extent);
+		return k < 0 ? 0 : min(k, settings.bins - 1);
+	}
+
+	void object_split(const vector<bvh_primitive>& refs, const aabb& centroid_bounds, double parent_area, split_choice& best) const;
+	void spatial_split(const vector<bvh_primitive>& refs, const aabb& bounds, double parent_area, split_choice& best) const;
+
+	// Moves the references to the side of the plane they lie on. Straddling ones are split
+	// while the budget lasts and the split is cheaper than keeping them whole on one side.
+	// Returns the number of references added.
+	size_t split_references(const vector<bvh_primitive>& refs, const aabb& bounds, const split_choice& split, size_t budget,
+		vector<bvh_primitive>& left, vector<bvh_primitive>& right) const;
+
+	unique_ptr<bvh_build_node> build_node(vector<bvh_primitive>& refs, size_t budget, int depth, int parallel_depth);
+};
+
+unique_ptr<bvh_build_node> sbvh_builder::build()
+{
+	int parallel_depth = 2;
+	for (unsigned n = thread::hardware_concurrency(); n > 1; n >>= 1)
+		++parallel_depth;
+
+	aabb bounds = prims[0].box;
+	for (const auto& p : prims)
+		bounds = surrounding_box(bounds, p.box);
+	root_area = bounds.surface_area();
+
+	size_t budget = size_t(prims.size() * fmax(settings.max_duplication, 0.0));
+	vector<bvh_primitive> refs;
+	refs.swap(prims);
+	auto root = build_node(refs, budget, 0, parallel_depth);
+
+	// lay the leaves out depth first
+	vector<bvh_build_node*> pending = { root.get() };
+	while (!pending.empty())
+	{
+		auto node = pending.back();
+		pending.pop_back();
+		if (node->is_leaf())
+		{
+			auto& leaf = leaves[node->first];
+			node->first = prims.size();
+			prims.insert(prims.end(), leaf.begin(), leaf.end());
+		}
+		else
+		{
+			pending.push_back(node->children[1].get());
+			pending.push_back(node->children[0].get());
+		}
+	}
+	leaves.clear();
+	return root;
+}
+
+void sbvh_builder::object_split(const vector<bvh_primitive>& refs, const aabb& centroid_bounds, double parent_area, split_choice& best) const
+{
+	struct bin
+	{
+		aabb box;
+		size_t count = 0;
+	};
+
+	const int bin_count = settings.bins;
+	vector<bin> bins(bin_count);
+	vector<double> right_cost(bin_count);
+	vector<aabb> right_box(bin_count);
+
+	for (int a = 0; a < 3; ++a)
+	{
+		double lo = centroid_bounds.min()[a];
+		double extent = centroid_bounds.max()[a] - lo;
+		if (extent <= 0)
+			continue;
+
+		for (auto& b : bins)
+			b.count = 0;
+		for (const auto& p : refs)
+		{
+			int k = bin_of(p.centroid[a], lo, extent);
+			bins[k].box = bins[k].count ? surrounding_box(bins[k].box, p.box) : p.box;
+			++bins[k].count;
+		}
+
+		aabb box;
+		size_t side = 0;
+		for (int k = bin_count - 1; k > 0; --k)
+		{
+			if (bins[k].count)
+			{
+				box = side ? surrounding_box(box, bins[k].box) : bins[k].box;
+				side += bins[k].count;
+			}
+			right_cost[k] = side ? side * box.surface_area() : 0;
+			right_box[k] = box;
+		}
+
+		side = 0;
+		for (int k = 1; k < bin_count; ++k)
+		{
+			if (bins[k - 1].count)
+			{
+				box = side ? surrounding_box(box, bins[k - 1].box) : bins[k - 1].box;
+				side += bins[k - 1].count;
+			}
+			if (side == 0 || side == refs.size())
+				continue;
+
+			double cost = settings.traversal_cost + (side * box.surface_area() + right_cost[k]) / parent_area;
+			if (cost < best.cost)
+			{
+				best.cost = cost;
+				best.axis = a;
+				best.bin = k;
+				best.left = box;
+				best.right = right_box[k];
+			}
+		}
+	}
+}
+
+void sbvh_builder::spatial_split(const vector<bvh_primitive>& refs, const aabb& bounds, double parent_area, split_choice& best) const
+{
+	struct bin
+	{
+		aabb box;
+		bool empty = true;
+		size_t entries = 0; // references starting in this bin
+		size_t exits = 0;   // references ending in this bin
+	};
+
+	const int bin_count = settings.bins;
+	vector<bin> bins(bin_count);
+	vector<double> right_cost(bin_count);
+	vector<size_t> right_count(bin_count);
+
+	for (int a = 0; a < 3; ++a)
+	{
+		double lo = bounds.min()[a];
+		double extent = bounds.max()[a] - lo;
+		if (extent <= 0)
+			continue;
+
+		for (auto& b : bins)
+			b = bin();
+		for (const auto& p : refs)
+		{
+			int first = bin_of(p.box.min()[a], lo, extent);
+			int last = bin_of(p.box.max()[a], lo, extent);
+			for (int k = first; k <= last; ++k)
+			{
+				aabb part = clip_box(p.box, a, lo + extent * k / bin_count, lo + extent * (k + 1) / bin_count);
+				bins[k].box = bins[k].empty ? part : surrounding_box(bins[k].box, part);
+				bins[k].empty = false;
+			}
+			++bins[first].entries;
+			++bins[last].exits;
+		}
+
+		aabb box;
+		bool empty = true;
+		size_t side = 0;
+		for (int k = bin_count - 1; k > 0; --k)
+		{
+			if (!bins[k].empty)
+			{
+				box = empty ? bins[k].box : surrounding_box(box, bins[k].box);
+				empty = false;
+			}
+			side += bins[k].exits;
+			right_cost[k] = side * box.surface_area();
+			right_count[k] = side;
+		}
+
+		empty = true;
+		side = 0;
+		for (int k = 1; k < bin_count; ++k)
+		{
+			if (!bins[k - 1].empty)
+			{
+				box = empty ? bins[k - 1].box : surrounding_box(box, bins[k - 1].box);
+				empty = false;
+			}
+			side += bins[k - 1].entries;
+			if (side == 0 || right_count[k] == 0)
+				continue;
+
+			double cost = settings.traversal_cost + (side * box.surface_area() + right_cost[k]) / parent_area;
+			if (cost < best.cost)
+			{
+				best.cost = cost;
+				best.axis = a;
+				best.bin = k;
+			}
+		}
+	}
+}
+
+size_t sbvh_builder::split_references(const vector<bvh_primitive>& refs, const aabb& bounds, const split_choice& split, size_t budget,
+	vector<bvh_primitive>& left, vector<bvh_primitive>& right) const
+{
+	int a = split.axis;
+	double lo = bounds.min()[a];
+	double extent = bounds.max()[a] - lo;
+	double plane = lo + extent * split.bin / settings.bins;
+
+	aabb left_box, right_box;
+	bool left_empty = true, right_empty = true;
+	auto grow = [](aabb& box, bool& empty, const aabb& b)
+	{
+		box = empty ? b : surrounding_box(box, b);
+		empty = false;
+	};
+
+	vector<bvh_primitive> straddling;
+	for (const auto& p : refs)
+	{
+		if (bin_of(p.box.max()[a], lo, extent) < split.bin)
+		{
+			left.push_back(p);
+			grow(left_box, left_empty, p.box);
+		}
+		else if (bin_of(p.box.min()[a], lo, extent) >= split.bin)
+		{
+			right.push_back(p);
+			grow(right_box, right_empty, p.box);
+		}
+		else
+		{
+			straddling.push_back(p);
+			grow(left_box, left_empty, clip_box(p.box, a, -infinity, plane));
+			grow(right_box, right_empty, clip_box(p.box, a, plane, infinity));
+		}
+	}
+
+	// Stich et al.'s unsplitting: keep a reference whole on one side when that is cheaper
+	double left_count = double(left.size() + straddling.size());
+	double right_count = double(right.size() + straddling.size());
+	size_t added = 0;
+	for (const auto& p : straddling)
+	{
+		double left_area = left_box.surface_area();
+		double right_area = right_box.surface_area();
+		double split_cost = left_area * left_count + right_area * right_count;
+		double left_cost = surrounding_box(left_box, p.box).surface_area() * left_count + right_area * (right_count - 1);
+		double right_cost = left_area * (left_count - 1) + surrounding_box(right_box, p.box).surface_area() * right_count;
+
+		if (added < budget && split_cost < left_cost && split_cost < right_cost)
+		{
+			bvh_primitive part = p;
+			part.box = clip_box(p.box, a, -infinity, plane);
+			part.centroid = part.box.centroid();
+			left.push_back(part);
+			part.box = clip_box(p.box, a, plane, infinity);
+			part.centroid = part.box.centroid();
+			right.push_back(part);
+			++added;
+		}
+		else if (left_cost <= right_cost)
+		{
+			left.push_back(p);
+			left_box = surrounding_box(left_box, p.box);
+			--right_count;
+		}
+		else
+		{
+			right.push_back(p);
+			right_box = surrounding_box(right_box, p.box);
+			--left_count;
+		}
+	}
+	return added;
+}
+
+unique_ptr<bvh_build_node> sbvh_builder::build_node(vector<bvh_primitive>& refs, size_t budget, int depth, int parallel_depth)
+{
+	auto node = make_unique<bvh_build_node>();
+	size_t count = refs.size();
+
+	node->box = refs[0].box;
+	aabb centroid_bounds(refs[0].centroid, refs[0].centroid);
+	for (const auto& p : refs)
+	{
+		node->box = surrounding_box(node->box, p.box);
+		centroid_bounds = surrounding_box(centroid_bounds, aabb(p.centroid, p.centroid));
+	}
+	double area = node->box.surface_area();
+	double parent_area = area > 0 ? area : 1;
+
+	split_choice object, spatial;
+	bool median = depth >= settings.max_depth && count > settings.max_leaf_size;
+	if (!median)
+	{
+		object_split(refs, centroid_bounds, parent_area, object);
+		if (budget > 0 && (object.axis < 0 || overlap_area(object.left, object.right) > settings.spatial_split_alpha * root_area))
+			spatial_split(refs, node->box, parent_area, spatial);
+
+		double best_cost = fmin(object.cost, spatial.cost);
+		if (count <= settings.max_leaf_size && best_cost >= count)
+		{
+			lock_guard<mutex> lock(leaves_mutex);
+			node->first = leaves.size();
+			node->count = count;
+			leaves.push_back(move(refs));
+			return node;
+		}
+	}
+
+	vector<bvh_primitive> left, right;
+	size_t added = 0;
+	if (spatial.cost < object.cost)
+	{
+		node->axis = spatial.axis;
+		added = split_references(refs, node->box, spatial, budget, left, right);
+	}
+	if (left.empty() || right.empty())
+	{
+		left.clear();
+		right.clear();
+		added = 0;
+
+		auto mid = refs.begin() + count / 2;
+		if (median || object.axis < 0)
+		{
+			// object median along the widest centroid axis; also halves coinciding centroids
+			auto extent = centroid_bounds.max() - centroid_bounds.min();
+			int a = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+			nth_element(refs.begin(), mid, refs.end(), [a](const bvh_primitive& p, const bvh_primitive& q)
+			{
+				return p.centroid[a] < q.centroid[a];
+			});
+			node->axis = a;
+		}
+		else
+		{
+			int a = object.axis;
+			double lo = centroid_bounds.min()[a];
+			double extent = centroid_bounds.max()[a] - lo;
+			mid = partition(refs.begin(), refs.end(), [&](const bvh_primitive& p) { return bin_of(p.centroid[a], lo, extent) < object.bin; });
+			node->axis = a;
+		}
+		left.assign(refs.begin(), mid);
+		right.assign(mid, refs.end());
+	}
+	vector<bvh_primitive>().swap(refs);
+
+	// the children share what is left of the budget by their size
+	size_t remaining = budget - added;
+	size_t left_budget = size_t(double(remaining) * left.size() / (left.size() + right.size()));
+	size_t right_budget = remaining - left_budget;
+
+	if (parallel_depth > 0 && count > settings.parallel_threshold)
+	{
+		auto left_node = async(launch::async, [&] { return build_node(left, left_budget, depth + 1, parallel_depth - 1); });
+		node->children[1] = build_node(right, right_budget, depth + 1, parallel_depth - 1);
+		node->children[0] = left_node.get();
+	}
+	else
+	{
+		node->children[0] = build_node(left, left_budget, depth + 1, parallel_depth);
+		node->children[1] = build_node(right, right_budget, depth + 1, parallel_depth);
+	}
+	return node;
+}
+
+// builds with the builder chosen in settings; prims are reordered in place, and the
+// sbvh builder adds a reference for every spatial split
+inline unique_ptr<bvh_build_node> build_bvh(vector<bvh_primitive>& prims, const bvh_build_settings& settings = bvh_build_settings())
+{
+	unique_ptr<bvh_build_node> root;
+	if (settings.builder == bvh_builder_type::lbvh && settings.treelet_passes > 0)
+	{
+		// single primitive leaves; the treelets pick the leaves by the SAH
+		bvh_build_settings lbvh_settings = settings;
+		lbvh_settings.max_leaf_size = 1;
+		root = lbvh_builder(prims, lbvh_settings).build();
+	}
+	else if (settings.builder == bvh_builder_type::lbvh)
+		root = lbvh_builder(prims, settings).build();
+	else if (settings.builder == bvh_builder_type::sbvh)
+		root = sbvh_builder(prims, settings).build();
+	else
+		root = sah_builder(prims, settings).build();
+
+	if (settings.treelet_passes > 0)
+	{
+		auto r = treelet_optimizer(settings).optimize(*root, prims);
+		if (settings.treelet_report)
+			settings.treelet_report->add(r);
+	}
+	return root;
 }
 
 class bvh_node : public hittable
@@ -42,9 +1454,21 @@ public:
 	bvh_node();
 	bvh_node(const hittable_list & list, double time0, double time1): bvh_node(list.objects, 0, list.objects.size(), time0, time1) {}
 	bvh_node(const vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1);
+	bvh_node(const vector<shared_ptr<hittable>>& objects, const vector<bvh_primitive>& prims, const bvh_build_node& node);
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+	{
+		return hit_closest(*this, r, t_min, t_max, rec);
+	}
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override
+	{
+		return box.hit(r, t_min, t_max) && (left->occluded(r, t_min, t_max) || (right != left && right->occluded(r, t_min, t_max)));
+	}
+
+	// hit() counting the nodes and primitives it tests
+	bool hit(const ray& r, double t_min, double t_max, hit_record& rec, traversal_stats& stats) const;
 };
 
 bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const
@@ -53,56 +1477,63 @@ bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const
 	return true;
 }
 
-bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool bvh_node::intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec) const
 {
 	if (!box.hit(r, t_min, t_max))
 		return false;
 
-	bool hit_left = left->hit(r, t_min, t_max, rec);
-	bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+	bool hit_left = left->intersect(r, t_min, t_max, c, rec);
+	bool hit_right = right->intersect(r, t_min, hit_left ? c.t : t_max, c, rec);
+
+	return hit_left || hit_right;
+}
+
+bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec, traversal_stats& stats) const
+{
+	stats.visit_node();
+	if (!box.hit(r, t_min, t_max))
+		return false;
+
+	auto child_hit = [&](const shared_ptr<hittable>& child, double t1)
+	{
+		if (auto node = dynamic_cast<const bvh_node*>(child.get()))
+			return node->hit(r, t_min, t1, rec, stats);
+		stats.test_primitive();
+		return child->hit(r, t_min, t1, rec);
+	};
+	bool hit_left = child_hit(left, t_max);
+	bool hit_right = child_hit(right, hit_left ? rec.t : t_max);
 
 	return hit_left || hit_right;
 }
 
 bvh_node::bvh_node(const vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1)
 {
-	auto objects = src_objects;
+	auto prims = gather_primitives(src_objects, start, end, time0, time1);
 
-	int axis = random_int(0, 2);
-	auto comparator = (axis == 0) ? box_x_compare : (axis == 1) ? box_y_compare : box_z_compare;
+	bvh_build_settings settings;
+	settings.max_leaf_size = 1; // every leaf of this tree is a single object
+	auto root = sah_builder(prims, settings).build();
 
-	size_t object_span = end - start;
+	*this = bvh_node(src_objects, prims, *root);
+}
 
-	if (object_span == 1)
-	{
-		left = right = objects[start]; // ҽһ
-	}
-	else if (object_span == 2)
+bvh_node::bvh_node(const vector<shared_ptr<hittable>>& objects, const vector<bvh_primitive>& prims, const bvh_build_node& node)
+{
+	auto child = [&](const bvh_build_node& c) -> shared_ptr<hittable>
 	{
-		if (comparator(objects[start], objects[start + 1]))
-		{
-			left = objects[start];
-			right = objects[start + 1];
-		}
-		else
-		{
-			left = objects[start + 1];
-			right = objects[start];
-		}
-	}
+		if (c.is_leaf())
+			return objects[prims[c.first].index];
+		return make_shared<bvh_node>(objects, prims, c);
+	};
+
+	if (node.is_leaf())
+		left = right = objects[prims[node.first].index]; // a single object
 	else
 	{
-		sort(objects.begin() + start, objects.begin() + end, comparator);
-		auto mid = start + object_span / 2;
-		left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-		right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+		left = child(*node.children[0]);
+		right = child(*node.children[1]);
 	}
-
-	aabb box_left, box_right;
-
-	if(!left->bounding_box(0, 0, box_left) || !right->bounding_box(0, 0, box_right))
-		cerr << "No bounding box in bvh_node constructor.\n";
-
-	box = surrounding_box(box_left, box_right);
+	box = node.box;
 }
 #endif // ! BVH_H
@@ -0,0 +1,226 @@
+#pragma once
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "flat_bvh.h"
+#include "mapped_file.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <typeinfo>
+
+using namespace std;
+
+// A cache file is this header followed by the nodes at node_offset and the primitive
+// indices at index_offset, both 64-byte aligned so a mapped file is used in place.
+struct bvh_cache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t node_size; // sizeof(flat_bvh_node), catches layout changes a version bump missed
+	uint64_t key;       // bvh_cache_key() of the objects and settings the tree was built for
+	uint64_t node_count;
+	uint64_t index_count;
+	uint64_t node_offset;
+	uint64_t index_offset;
+	double cost;        // sah_cost() right after the build
+};
+
+const char bvh_cache_magic[8] = { 'R', 'T', 'B', 'V', 'H', 'C', 0, 0 };
+const uint32_t bvh_cache_version = 2;
+const size_t bvh_cache_objects_per_chunk = 65536; // fixed, so the key does not depend on the core count
+
+inline uint64_t hash_combine(uint64_t h, uint64_t value)
+{
+	return mix64(h ^ (value + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2)));
+}
+
+inline uint64_t hash_double(uint64_t h, double x)
+{
+	uint64_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	return hash_combine(h, bits);
+}
+
+// hash_code() may differ between runs, and the key is saved, so types are hashed by name
+inline uint64_t hash_string(uint64_t h, const char* text)
+{
+	for (; *text; ++text)
+		h = hash_combine(h, uint64_t(uint8_t(*text)));
+	return h;
+}
+
+// Hash of everything the tree depends on: every object's dynamic type and bounding box
+// over [time0, time1], in order, and the settings that change the tree. Chunks of objects
+// are hashed in parallel and combined in order.
+inline uint64_t bvh_cache_key(const vector<shared_ptr<hittable>>& objects, double time0, double time1, const bvh_build_settings& settings)
+{
+	size_t chunk_count = (objects.size() + bvh_cache_objects_per_chunk - 1) / bvh_cache_objects_per_chunk;
+	vector<uint64_t> chunk_hashes(chunk_count);
+	parallel_chunks(chunk_count, parallel_chunk_count(chunk_count, 1), [&](size_t, size_t first, size_t last)
+	{
+		for (size_t c = first; c < last; ++c)
+		{
+			uint64_t h = c;
+			const type_info* last_type = nullptr;
+			uint64_t type_hash = 0; // of last_type, which is usually the next object's type too
+			size_t end = min(objects.size(), (c + 1) * bvh_cache_objects_per_chunk);
+			for (size_t n = c * bvh_cache_objects_per_chunk; n < end; ++n)
+			{
+				aabb box;
+				bool bounded = objects[n]->bounding_box(time0, time1, box);
+				const type_info& type = typeid(*objects[n]);
+				if (&type != last_type)
+				{
+					last_type = &type;
+					type_hash = hash_string(0, type.name());
+				}
+				h = hash_combine(h, type_hash);
+				h = hash_combine(h, bounded);
+				for (int a = 0; a < 3; ++a)
+				{
+					h = hash_double(h, box.min()[a]);
+					h = hash_double(h, box.max()[a]);
+				}
+			}
+			chunk_hashes[c] = h;
+		}
+	});
+
+	uint64_t key = hash_combine(bvh_cache_version, objects.size());
+	key = hash_combine(key, uint64_t(settings.builder));
+	key = hash_combine(key, uint64_t(settings.bins));
+	key = hash_combine(key, uint64_t(settings.max_leaf_size));
+	key = hash_double(key, settings.traversal_cost);
+	key = hash_combine(key, uint64_t(settings.max_depth));
+	key = hash_combine(key, uint64_t(settings.morton_bits));
+	key = hash_combine(key, uint64_t(settings.sah_clusters));
+	key = hash_double(key, settings.spatial_split_alpha);
+	key = hash_double(key, settings.max_duplication);
+	key = hash_combine(key, uint64_t(settings.treelet_passes));
+	key = hash_combine(key, uint64_t(settings.treelet_size));
+	for (auto h : chunk_hashes)
+		key = hash_combine(key, h);
+	return key;
+}
+
+inline uint64_t align_cache_offset(uint64_t offset)
+{
+	return (offset + 63) & ~uint64_t(63);
+}
+
+// Writes to a temporary file first and renames it, so no reader maps a partial file.
+inline bool save_bvh_cache(const string& filename, uint64_t key, const flat_bvh_tree& tree, double cost)
+{
+	bvh_cache_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, bvh_cache_magic, sizeof(header.magic));
+	header.version = bvh_cache_version;
+	header.node_size = sizeof(flat_bvh_node);
+	header.key = key;
+	header.node_count = tree.nodes.size();
+	header.index_count = tree.indices.size();
+	header.node_offset = align_cache_offset(sizeof(header));
+	header.index_offset = align_cache_offset(header.node_offset + header.node_count * sizeof(flat_bvh_node));
+	header.cost = cost;
+
+	string temporary = filename + ".tmp";
+	{
+		ofstream out(temporary, ios::binary);
+		const char zeros[64] = {};
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(zeros, header.node_offset - sizeof(header));
+		out.write(reinterpret_cast<const char*>(tree.nodes.data()), header.node_count * sizeof(flat_bvh_node));
+		out.write(zeros, header.index_offset - header.node_offset - header.node_count * sizeof(flat_bvh_node));
+		out.write(reinterpret_cast<const char*>(tree.indices.data()), header.index_count * sizeof(uint32_t));
+		if (!out)
+			return false;
+	}
+
+	remove(filename.c_str()); // rename does not replace an existing file on Windows
+	return rename(temporary.c_str(), filename.c_str()) == 0;
+}
+
+// True if every reference of a mapped tree stays in range: an interior node's second
+// child lies after it, a leaf's slots within the indices, and every index names one of
+// the objects. flat_bvh reads all the indices anyway, so this adds no page faults worth
+// counting, and a stale or colliding cache is rebuilt instead of read out of bounds.
+inline bool valid_bvh_cache_tree(const flat_bvh_node* nodes, size_t node_count, const uint32_t* indices, size_t index_count, size_t object_count)
+{
+	if (node_count == 0)
+		return object_count == 0;
+	for (size_t i = 0; i < node_count; ++i)
+	{
+		const flat_bvh_node& node = nodes[i];
+		if (node.is_leaf() ? node.offset > index_count || node.count > index_count - node.offset
+			: node.offset <= i + 1 || node.offset >= node_count)
+			return false;
+	}
+	for (size_t i = 0; i < index_count; ++i)
+	{
+		if (indices[i] >= object_count)
+			return false;
+	}
+	return true;
+}
+
+// Maps filename and points tree at the nodes and indices inside it, without copying or
+// parsing them. Fails and leaves tree alone if the file is missing, truncated, from
+// another version, built for other objects, or refers outside its own arrays. Spatial
+// splits leave more indices than objects.
+inline bool load_bvh_cache(const string& filename, uint64_t key, size_t object_count, flat_bvh_tree& tree, double& cost)
+{
+	auto file = make_shared<mapped_file>();
+	if (!file->open(filename) || file->size() < sizeof(bvh_cache_header))
+		return false;
+
+	bvh_cache_header header;
+	memcpy(&header, file->data(), sizeof(header));
+	if (memcmp(header.magic, bvh_cache_magic, sizeof(header.magic)) != 0 || header.version != bvh_cache_version
+		|| header.node_size != sizeof(flat_bvh_node) || header.key != key || header.index_count < object_count)
+		return false;
+	// compared as counts, so a corrupt header cannot overflow the sums
+	if (header.node_offset % 64 || header.index_offset % 64 || header.node_offset < sizeof(header)
+		|| header.node_offset > header.index_offset || header.index_offset > file->size()
+		|| header.node_count > (header.index_offset - header.node_offset) / sizeof(flat_bvh_node)
+		|| header.index_count > (file->size() - header.index_offset) / sizeof(uint32_t))
+		return false;
+
+	auto nodes = reinterpret_cast<const flat_bvh_node*>(file->data() + header.node_offset);
+	auto indices = reinterpret_cast<const uint32_t*>(file->data() + header.index_offset);
+	if (!valid_bvh_cache_tree(nodes, size_t(header.node_count), indices, size_t(header.index_count), object_count))
+		return false;
+
+	tree.nodes.map(nodes, size_t(header.node_count), file);
+	tree.indices.map(indices, size_t(header.index_count), file);
+	cost = header.cost;
+	return true;
+}
+
+// flat_bvh over objects, mapped from cache_dir when an earlier run built it for the same
+// objects and settings, otherwise built and saved there. loaded tells which happened.
+inline shared_ptr<flat_bvh> make_cached_flat_bvh(const vector<shared_ptr<hittable>>& objects, double time0, double time1,
+	const string& cache_dir, const bvh_build_settings& settings = bvh_build_settings(), bool* loaded = nullptr)
+{
+	uint64_t key = bvh_cache_key(objects, time0, time1, settings);
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)key);
+	string filename = cache_dir.empty() ? string(name) : cache_dir + "/" + name;
+
+	flat_bvh_tree tree;
+	double cost = 0;
+	bool hit = load_bvh_cache(filename, key, objects.size(), tree, cost);
+	if (loaded)
+		*loaded = hit;
+	if (hit)
+		return make_shared<flat_bvh>(objects, move(tree), cost, settings);
+
+	auto bvh = make_shared<flat_bvh>(objects, time0, time1, settings);
+	if (!save_bvh_cache(filename, key, bvh->tree, bvh->built_cost))
+		cerr << "Could not write BVH cache '" << filename << "'.\n";
+	return bvh;
+}
+#endif // !BVH_CACHE_H
@@ -0,0 +1,381 @@
+#pragma once
+#ifndef BVH_REPORT_H
+#define BVH_REPORT_H
+
+#include "hittable_list.h"
+#include "bvh.h"
+#include "flat_bvh.h"
+#include "wide_bvh.h"
+#include "quantized_bvh.h"
+#include "motion_bvh.h"
+#include "instance.h"
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Shape and cost of a built acceleration structure, to tell a slow tree from a slow scene.
+struct bvh_report
+{
+	string type;
+	size_t trees = 0;           // motion_bvh has one per time segment
+	size_t nodes = 0;           // stored nodes; leaves of the wide trees live inside their parents
+	size_t leaves = 0;
+	size_t references = 0;      // primitive slots in the leaves, more than primitives after spatial splits
+	size_t max_depth = 0;
+	double sah_cost = 0;        // relative to one primitive test, averaged over the trees; one step per wide node
+	double sibling_overlap = 0; // mean overlap area of two siblings over their parent's area
+	size_t memory_bytes = 0;    // nodes and slot indices, not the primitives
+	vector<size_t> leaf_depths; // leaves per depth
+	vector<size_t> leaf_sizes;  // leaves per primitive count
+	traversal_stats rays;       // filled by trace_bvh_report()
+
+	void add_leaf(size_t depth, size_t count);
+	void add_siblings(const aabb* boxes, int count, const aabb& parent);
+	// averages what the walkers summed; called once all trees were added
+	void finish();
+
+	void write_json(ostream& out) const;
+
+private:
+	double overlap_sum = 0;
+	size_t sibling_pairs = 0;
+};
+
+void bvh_report::add_leaf(size_t depth, size_t count)
+{
+	++leaves;
+	references += count;
+	max_depth = max(max_depth, depth);
+	if (leaf_depths.size() <= depth)
+		leaf_depths.resize(depth + 1);
+	++leaf_depths[depth];
+	if (leaf_sizes.size() <= count)
+		leaf_sizes.resize(count + 1);
+	++leaf_sizes[count];
+}
+
+void bvh_report::add_siblings(const aabb* boxes, int count, const aabb& parent)
+{
+	double area = parent.surface_area();
+	for (int i = 0; i < count; ++i)
+	{
+		for (int j = i + 1; j < count; ++j)
+		{
+			overlap_sum += area > 0 ? overlap_area(boxes[i], boxes[j]) / area : 0;
+			++sibling_pairs;
+		}
+	}
+}
+
+void bvh_report::finish()
+{
+	if (trees > 1)
+		sah_cost /= trees;
+	sibling_overlap = sibling_pairs ? overlap_sum / sibling_pairs : 0;
+}
+
+void bvh_report::write_json(ostream& out) const
+{
+	auto write_array = [&](const vector<size_t>& values)
+	{
+		out << "[";
+		for (size_t n = 0; n < values.size(); ++n)
+			out << (n ? ", " : "") << values[n];
+		out << "]";
+	};
+
+	out << "{\n";
+	out << "  \"type\": \"" << type << "\",\n";
+	out << "  \"trees\": " << trees << ",\n";
+	out << "  \"nodes\": " << nodes << ",\n";
+	out << "  \"leaves\": " << leaves << ",\n";
+	out << "  \"references\": " << references << ",\n";
+	out << "  \"max_depth\": " << max_depth << ",\n";
+	out << "  \"sah_cost\": " << sah_cost << ",\n";
+	out << "  \"sibling_overlap\": " << sibling_overlap << ",\n";
+	out << "  \"memory_bytes\": " << memory_bytes << ",\n";
+	out << "  \"leaf_depth_histogram\": ";
+	write_array(leaf_depths);
+	out << ",\n  \"leaf_size_histogram\": ";
+	write_array(leaf_sizes);
+	if (rays.rays > 0)
+	{
+		out << ",\n  \"rays\": { \"count\": " << rays.rays
+			<< ", \"nodes_per_ray\": " << double(rays.nodes) / rays.rays
+			<< ", \"primitives_per_ray\": " << double(rays.primitives) / rays.rays << " }";
+	}
+	out << "\n}\n";
+}
+
+// The walkers below add one tree each to a report.
+
+inline void add_to_report(const flat_bvh_tree& tree, double traversal_cost, bvh_report& report)
+{
+	if (tree.nodes.empty())
+		return;
+
+	// parents precede their children, so one forward pass assigns every depth
+	vector<uint32_t> depth(tree.nodes.size(), 0);
+	double cost = 0;
+	for (uint32_t i = 0; i < tree.nodes.size(); ++i)
+	{
+		const flat_bvh_node& node = tree.nodes.begin()[i];
+		cost += node.box().surface_area() * (node.is_leaf() ? node.count : traversal_cost);
+		if (node.is_leaf())
+		{
+			report.add_leaf(depth[i], node.count);
+			continue;
+		}
+		depth[i + 1] = depth[node.offset] = depth[i] + 1;
+		aabb children[2] = { tree.nodes.begin()[i + 1].box(), tree.nodes.begin()[node.offset].box() };
+		report.add_siblings(children, 2, node.box());
+	}
+
+	double root_area = tree.nodes.begin()->box().surface_area();
+	report.sah_cost += root_area > 0 ? cost / root_area : cost;
+	report.nodes += tree.nodes.size();
+	report.memory_bytes += tree.nodes.size() * sizeof(flat_bvh_node) + tree.indices.size() * sizeof(uint32_t);
+	++report.trees;
+}
+
+// Shared by the wide trees: child_box(node, k) is child k's box as the traversal sees it.
+template<int N, typename tree_type, typename box_fn>
+void add_wide_to_report(const tree_type& tree, box_fn child_box, double traversal_cost, bvh_report& report)
+{
+	if (tree.nodes.empty())
+		return;
+
+	// children are collapsed after their parent, so one forward pass assigns every depth
+	vector<uint32_t> depth(tree.nodes.size(), 0);
+	double cost = 0;
+	double root_area = 0;
+	for (uint32_t i = 0; i < tree.nodes.size(); ++i)
+	{
+		const auto& node = tree.nodes[i];
+		aabb boxes[N];
+		aabb box = child_box(node, 0);
+		for (int k = 0; k < node.num_children; ++k)
+		{
+			boxes[k] = child_box(node, k);
+			box = surrounding_box(box, boxes[k]);
+			if (node.count[k] > 0)
+			{
+				report.add_leaf(depth[i] + 1, node.count[k]);
+				cost += boxes[k].surface_area() * node.count[k];
+			}
+			else
+				depth[node.child[k]] = depth[i] + 1;
+		}
+		report.add_siblings(boxes, node.num_children, box);
+		cost += box.surface_area() * traversal_cost;
+		if (i == 0)
+			root_area = box.surface_area();
+	}
+
+	report.sah_cost += root_area > 0 ? cost / root_area : cost;
+	report.nodes += tree.nodes.size();
+	report.memory_bytes += tree.nodes.size() * sizeof(tree.nodes[0]) + tree.indices.size() * sizeof(uint32_t);
+	++report.trees;
+}
+
+template<int N>
+void add_to_report(const wide_bvh_tree<N>& tree, double traversal_cost, bvh_report& report)
+{
+	add_wide_to_report<N>(tree, [](const wide_bvh_node<N>& node, int k)
+	{
+		return aabb(point3(node.bounds[0][0][k], node.bounds[0][1][k], node.bounds[0][2][k]),
+			point3(node.bounds[1][0][k], node.bounds[1][1][k], node.bounds[1][2][k]));
+	}, traversal_cost, report);
+}
+
+// boxes as decoded by the traversal
+inline void add_to_report(const quantized_bvh4_tree& tree, double traversal_cost, bvh_report& report)
+{
+	add_wide_to_report<4>(tree, [](const quantized_bvh4_node& node, int k)
+	{
+		return aabb(point3(quantized_bound(node, 0, 0, k), quantized_bound(node, 0, 1, k), quantized_bound(node, 0, 2, k)),
+			point3(quantized_bound(node, 1, 0, k), quantized_bound(node, 1, 1, k), quantized_bound(node, 1, 2, k)));
+	}, traversal_cost, report);
+}
+
+// node boxes are taken in the middle of the tree's time interval
+inline void add_to_report(const motion_bvh_tree& tree, double traversal_cost, bvh_report& report)
+{
+	if (tree.nodes.empty())
+		return;
+
+	auto mid_box = [](const motion_bvh_node& node)
+	{
+		point3 lo, hi;
+		for (int a = 0; a < 3; ++a)
+		{
+			lo[a] = 0.5 * (double(node.bounds[0][0][a]) + node.bounds[1][0][a]);
+			hi[a] = 0.5 * (double(node.bounds[0][1][a]) + node.bounds[1][1][a]);
+		}
+		return aabb(lo, hi);
+	};
+
+	vector<uint32_t> depth(tree.nodes.size(), 0);
+	double cost = 0;
+	for (uint32_t i = 0; i < tree.nodes.size(); ++i)
+	{
+		const motion_bvh_node& node = tree.nodes[i];
+		aabb box = mid_box(node);
+		cost += box.surface_area() * (node.is_leaf() ? node.count : traversal_cost);
+		if (node.is_leaf())
+		{
+			report.add_leaf(depth[i], node.count);
+			continue;
+		}
+		depth[i + 1] = depth[node.offset] = depth[i] + 1;
+		aabb children[2] = { mid_box(tree.nodes[i + 1]), mid_box(tree.nodes[node.offset]) };
+		report.add_siblings(children, 2, box);
+	}
+
+	double root_area = mid_box(tree.nodes[0]).surface_area();
+	report.sah_cost += root_area > 0 ? cost / root_area : cost;
+	report.nodes += tree.nodes.size();
+	report.memory_bytes += tree.nodes.size() * sizeof(motion_bvh_node) + tree.indices.size() * sizeof(uint32_t);
+	++report.trees;
+}
+
+inline void add_to_report(const bvh_node& root, double traversal_cost, bvh_report& report)
+{
+	double cost = 0;
+	vector<pair<const bvh_node*, size_t>> pending = { { &root, 0 } };
+	while (!pending.empty())
+	{
+		auto node = pending.back().first;
+		size_t depth = pending.back().second;
+		pending.pop_back();
+
+		++report.nodes;
+		cost += node->box.surface_area() * traversal_cost;
+
+		// a single object sits in both children
+		int count = node->left == node->right ? 1 : 2;
+		const shared_ptr<hittable> children[2] = { node->left, node->right };
+		aabb boxes[2];
+		for (int k = 0; k < count; ++k)
+		{
+			children[k]->bounding_box(0, 1, boxes[k]);
+			if (auto child = dynamic_cast<const bvh_node*>(children[k].get()))
+				pending.push_back({ child, depth + 1 });
+			else
+			{
+				report.add_leaf(depth + 1, 1);
+				cost += boxes[k].surface_area();
+			}
+		}
+		if (count == 2)
+			report.add_siblings(boxes, 2, node->box);
+	}
+
+	double root_area = root.box.surface_area();
+	report.sah_cost += root_area > 0 ? cost / root_area : cost;
+	report.memory_bytes += report.nodes * sizeof(bvh_node);
+	++report.trees;
+}
+
+// The acceleration structure inside accel, looking through the hittable_list that
+// make_scene_accel() puts around a tree when there are unbounded objects. Null if none.
+inline const hittable* find_accel(const hittable& accel)
+{
+	if (dynamic_cast<const flat_bvh*>(&accel) || dynamic_cast<const bvh4*>(&accel) || dynamic_cast<const bvh8*>(&accel) || dynamic_cast<const quantized_bvh4*>(&accel)
+		|| dynamic_cast<const motion_bvh*>(&accel) || dynamic_cast<const instance_bvh*>(&accel) || dynamic_cast<const bvh_node*>(&accel))
+		return &accel;
+
+	if (auto list = dynamic_cast<const hittable_list*>(&accel))
+	{
+		for (const auto& object : list->objects)
+		{
+			if (auto found = find_accel(*object))
+				return found;
+		}
+	}
+	return nullptr;
+}
+
+// Fills report with the shape of the acceleration structure find_accel() finds in accel.
+// An instance_bvh reports its top level. Returns false if accel holds none.
+inline bool make_bvh_report(const hittable& accel, bvh_report& report, double traversal_cost = 1.0)
+{
+	report = bvh_report();
+	auto found = find_accel(accel);
+	if (auto p = dynamic_cast<const flat_bvh*>(found))
+	{
+		report.type = "binary";
+		add_to_report(p->tree, traversal_cost, report);
+	}
+	else if (auto p = dynamic_cast<const bvh4*>(found))
+	{
+		report.type = "bvh4";
+		add_to_report(p->tree, traversal_cost, report);
+	}
+	else if (auto p = dynamic_cast<const bvh8*>(found))
+	{
+		report.type = "bvh8";
+		add_to_report(p->tree, traversal_cost, report);
+	}
+	else if (auto p = dynamic_cast<const quantized_bvh4*>(found))
+	{
+		report.type = "bvh4q";
+		add_to_report(p->tree, traversal_cost, report);
+	}
+	else if (auto p = dynamic_cast<const motion_bvh*>(found))
+	{
+		report.type = "motion";
+		for (const auto& segment : p->segments)
+			add_to_report(segment, traversal_cost, report);
+	}
+	else if (auto p = dynamic_cast<const instance_bvh*>(found))
+	{
+		report.type = "instance";
+		add_to_report(p->tree, traversal_cost, report);
+	}
+	else if (auto p = dynamic_cast<const bvh_node*>(found))
+	{
+		report.type = "bvh_node";
+		add_to_report(*p, traversal_cost, report);
+	}
+	else
+		return false;
+
+	report.finish();
+	return true;
+}
+
+// Traces rays through the structure find_accel() finds in accel and counts the nodes and
+// primitives they test into report.rays. Only that structure is counted: a primitive with
+// a tree of its own, such as an instance or a box, is one primitive test.
+inline void trace_bvh_report(const hittable& accel, const vector<ray>& rays, bvh_report& report)
+{
+	auto found = find_accel(accel);
+	if (!found)
+		return;
+
+	auto& stats = report.rays;
+	for (const auto& r : rays)
+	{
+		hit_record rec;
+		if (auto p = dynamic_cast<const flat_bvh*>(found))
+			p->hit(r, 0.001, infinity, rec, stats);
+		else if (auto p = dynamic_cast<const bvh4*>(found))
+			p->hit(r, 0.001, infinity, rec, stats);
+		else if (auto p = dynamic_cast<const bvh8*>(found))
+			p->hit(r, 0.001, infinity, rec, stats);
+		else if (auto p = dynamic_cast<const quantized_bvh4*>(found))
+			p->hit(r, 0.001, infinity, rec, stats);
+		else if (auto p = dynamic_cast<const motion_bvh*>(found))
+			p->hit(r, 0.001, infinity, rec, stats);
+		else if (auto p = dynamic_cast<const instance_bvh*>(found))
+			p->hit(r, 0.001, infinity, rec, stats);
+		else if (auto p = dynamic_cast<const bvh_node*>(found))
+			p->hit(r, 0.001, infinity, rec, stats);
+		++stats.rays;
+	}
+}
+#endif // !BVH_REPORT_H
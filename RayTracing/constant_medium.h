@@ -57,12 +57,12 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
     if (hit_distance > distance_inside_boundry)
         return false;
     
-    rec.t = rec.t + hit_distance / ray_length;
+    rec.t = rec1.t + hit_distance / ray_length;
     rec.pt = r.at(rec.t);
     
     rec.normal = vec3(1, 0, 0);
     rec.front_face = true;
-    rec.mat_ptr = phase_function;
+    rec.mat_ptr = phase_function.get();
     
     return true;
 }
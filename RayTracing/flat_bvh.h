@@ -0,0 +1,435 @@
+#pragma once
+#ifndef FLAT_BVH_H
+#define FLAT_BVH_H
+
+#include "bvh.h"
+#include "mapped_file.h"
+
+#include <cfloat>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+
+// 32-byte node of a depth-first flattened BVH. The first child of an interior node
+// directly follows it, so only the second child needs an offset.
+struct flat_bvh_node
+{
+	float bounds[2][3]; // min and max corner, rounded outward from the double precision box
+	uint32_t offset;    // interior: index of the second child; leaf: first primitive slot
+	uint16_t count;     // number of primitives of a leaf, 0 for interior nodes
+	uint8_t axis;       // split axis of an interior node
+	uint8_t pad;
+
+	bool is_leaf() const { return count > 0; }
+
+	aabb box() const
+	{
+		return aabb(point3(bounds[0][0], bounds[0][1], bounds[0][2]), point3(bounds[1][0], bounds[1][1], bounds[1][2]));
+	}
+};
+
+static_assert(sizeof(flat_bvh_node) == 32, "flat_bvh_node should stay 32 bytes");
+
+inline float round_down(double x)
+{
+	float f = float(x);
+	return double(f) > x ? nextafterf(f, -INFINITY) : f;
+}
+
+inline float round_up(double x)
+{
+	float f = float(x);
+	return double(f) < x ? nextafterf(f, INFINITY) : f;
+}
+
+// The far slab distance is scaled up by a few ulps so rounding in the slab test cannot
+// cull a box the ray only touches at an edge or corner, where meshes share vertices.
+const double flat_bvh_far_scale = 1.0 + 4 * DBL_EPSILON;
+
+// Ray data shared by every box test of one traversal.
+struct ray_box_setup
+{
+	double origin[3];
+	double inv_dir[3];
+	int dir_is_neg[3];
+
+	ray_box_setup(const ray& r)
+	{
+		for (int a = 0; a < 3; ++a)
+		{
+			origin[a] = r.origin()[a];
+			inv_dir[a] = 1.0 / r.direction()[a];
+			dir_is_neg[a] = inv_dir[a] < 0;
+		}
+	}
+
+	bool hit(const float bounds[2][3], double t_min, double t_max) const
+	{
+		for (int a = 0; a < 3; ++a)
+		{
+			double t0 = (bounds[dir_is_neg[a]][a] - origin[a]) * inv_dir[a];
+			double t1 = (bounds[1 - dir_is_neg[a]][a] - origin[a]) * inv_dir[a] * flat_bvh_far_scale;
+			t_min = t0 > t_min ? t0 : t_min;
+			t_max = t1 < t_max ? t1 : t_max;
+			if (t_max < t_min)
+				return false;
+		}
+		return true;
+	}
+};
+
+// Node array plus the primitive slots referenced by the leaves. It knows nothing about
+// the primitives themselves, so any leaf type can be traversed with it.
+class flat_bvh_tree
+{
+public:
+	// owned after a build, or views into a mapped cache file (see bvh_cache.h)
+	mappable_vector<flat_bvh_node> nodes;
+	mappable_vector<uint32_t> indices; // slot -> index into the primitive array handed to build()
+
+	void build(vector<bvh_primitive>& prims, const bvh_build_settings& settings = bvh_build_settings())
+	{
+		auto root = build_bvh(prims, settings);
+		flatten(*root, prims);
+	}
+
+	// post-build step, turns any build tree into the linear layout
+	void flatten(const bvh_build_node& root, const vector<bvh_primitive>& prims);
+
+	// Visits the leaves hit by r, nearer child first. leaf(slot, t_min, t_max) tests one
+	// primitive slot and shrinks t_max when it finds a closer hit; setting t_max below
+	// t_min ends the walk, which is how occluded() stops at its first hit. stats counts
+	// the work.
+	template<typename leaf_fn, typename stats_type = no_traversal_stats>
+	bool traverse(const ray& r, double t_min, double t_max, leaf_fn leaf, stats_type&& stats = stats_type()) const;
+
+	// Updates the node bounds bottom-up after primitives moved, keeping the topology.
+	// slot_box(slot) returns the new box of one primitive slot. All nodes of one level are
+	// independent and are refit in parallel, the deepest level first.
+	template<typename box_fn>
+	void refit(box_fn slot_box);
+
+	// SAH cost of the tree relative to one primitive test
+	double sah_cost(double traversal_cost = 1.0) const;
+
+private:
+	vector<uint32_t> level_order; // node indices, grouped by depth
+	vector<size_t> level_start;   // level d is level_order[level_start[d], level_start[d + 1])
+
+	uint32_t flatten_node(const bvh_build_node& node, const vector<bvh_primitive>& prims);
+	void compute_levels();
+};
+
+void flat_bvh_tree::flatten(const bvh_build_node& root, const vector<bvh_primitive>& prims)
+{
+	nodes.clear();
+	indices.clear();
+	level_order.clear();
+	flatten_node(root, prims);
+}
+
+uint32_t flat_bvh_tree::flatten_node(const bvh_build_node& node, const vector<bvh_primitive>& prims)
+{
+	uint32_t index = uint32_t(nodes.size());
+	nodes.emplace_back();
+
+	flat_bvh_node flat;
+	for (int a = 0; a < 3; ++a)
+	{
+		flat.bounds[0][a] = round_down(node.box.min()[a]);
+		flat.bounds[1][a] = round_up(node.box.max()[a]);
+	}
+	flat.axis = uint8_t(node.axis);
+	flat.pad = 0;
+
+	if (node.is_leaf())
+	{
+		flat.offset = uint32_t(indices.size());
+		flat.count = uint16_t(node.count);
+		for (size_t n = node.first; n < node.first + node.count; ++n)
+			indices.push_back(uint32_t(prims[n].index));
+	}
+	else
+	{
+		flat.count = 0;
+		flatten_node(*node.children[0], prims);
+		flat.offset = flatten_node(*node.children[1], prims);
+	}
+
+	nodes[index] = flat;
+	return index;
+}
+
+void flat_bvh_tree::compute_levels()
+{
+	// parents precede their children, so one forward pass assigns every depth
+	vector<uint32_t> depth(nodes.size(), 0);
+	uint32_t max_depth = 0;
+	for (uint32_t i = 0; i < nodes.size(); ++i)
+	{
+		max_depth = max(max_depth, depth[i]);
+		if (!nodes[i].is_leaf())
+			depth[i + 1] = depth[nodes[i].offset] = depth[i] + 1;
+	}
+
+	level_start.assign(max_depth + 2, 0);
+	for (auto d : depth)
+		++level_start[d + 1];
+	for (size_t d = 1; d < level_start.size(); ++d)
+		level_start[d] += level_start[d - 1];
+
+	level_order.resize(nodes.size());
+	vector<size_t> next(level_start.begin(), level_start.end() - 1);
+	for (uint32_t i = 0; i < nodes.size(); ++i)
+		level_order[next[depth[i]]++] = i;
+}
+
+template<typename box_fn>
+void flat_bvh_tree::refit(box_fn slot_box)
+{
+	if (nodes.empty())
+		return;
+	nodes.make_owned(); // before the threads write to it
+	if (level_order.size() != nodes.size())
+		compute_levels();
+
+	for (size_t level = level_start.size() - 1; level-- > 0;)
+	{
+		size_t begin = level_start[level];
+		size_t count = level_start[level + 1] - begin;
+		parallel_chunks(count, parallel_chunk_count(count, 4096), [&](size_t, size_t first, size_t last)
+		{
+			for (size_t k = first; k < last; ++k)
+			{
+				flat_bvh_node& node = nodes[level_order[begin + k]];
+				if (node.is_leaf())
+				{
+					aabb box = slot_box(node.offset);
+					for (uint32_t slot = node.offset + 1; slot < node.offset + node.count; ++slot)
+						box = surrounding_box(box, slot_box(slot));
+					for (int a = 0; a < 3; ++a)
+					{
+						node.bounds[0][a] = round_down(box.min()[a]);
+						node.bounds[1][a] = round_up(box.max()[a]);
+					}
+				}
+				else
+				{
+					const flat_bvh_node& left = *(&node + 1);
+					const flat_bvh_node& right = nodes[node.offset];
+					for (int a = 0; a < 3; ++a)
+					{
+						node.bounds[0][a] = min(left.bounds[0][a], right.bounds[0][a]);
+						node.bounds[1][a] = max(left.bounds[1][a], right.bounds[1][a]);
+					}
+				}
+			}
+		});
+	}
+}
+
+double flat_bvh_tree::sah_cost(double traversal_cost) const
+{
+	if (nodes.empty())
+		return 0;
+
+	double cost = 0;
+	for (const auto& node : nodes)
+		cost += node.box().surface_area() * (node.is_leaf() ? node.count : traversal_cost);
+
+	double root_area = nodes[0].box().surface_area();
+	return root_area > 0 ? cost / root_area : cost;
+}
+
+template<typename leaf_fn, typename stats_type>
+bool flat_bvh_tree::traverse(const ray& r, double t_min, double t_max, leaf_fn leaf, stats_type&& stats) const
+{
+	if (nodes.empty())
+		return false;
+
+	ray_box_setup setup(r);
+	const flat_bvh_node* node_data = nodes.data();
+	uint32_t stack[bvh_stack_size];
+	int stack_size = 0;
+	uint32_t current = 0;
+	bool hit_anything = false;
+
+	while (true)
+	{
+		const flat_bvh_node& node = node_data[current];
+		stats.visit_node();
+		if (setup.hit(node.bounds, t_min, t_max))
+		{
+			if (node.is_leaf())
+			{
+				for (uint32_t slot = node.offset; slot < node.offset + node.count; ++slot)
+				{
+					stats.test_primitive();
+					if (leaf(slot, t_min, t_max))
+					{
+						hit_anything = true;
+						if (t_max < t_min)
+							return true; // any-hit query done
+					}
+				}
+			}
+			else if (setup.dir_is_neg[node.axis])
+			{
+				stack[stack_size++] = current + 1;
+				current = node.offset;
+				continue;
+			}
+			else
+			{
+				stack[stack_size++] = node.offset;
+				current = current + 1;
+				continue;
+			}
+		}
+
+		if (stack_size == 0)
+			break;
+		current = stack[--stack_size];
+	}
+	return hit_anything;
+}
+
+// Flattened BVH over hittables. Objects are stored in leaf order, so each leaf is a
+// contiguous range of the objects vector.
+class flat_bvh : public hittable
+{
+public:
+	vector<shared_ptr<hittable>> objects;
+	flat_bvh_tree tree;
+	aabb box;
+	bvh_build_settings settings;
+	double built_cost = 0;        // SAH cost right after the last build
+	double max_cost_growth = 1.5; // update() rebuilds once refitting made the tree this much more expensive
+
+	flat_bvh(const hittable_list& list, double time0, double time1, const bvh_build_settings& build_settings = bvh_build_settings())
+		: flat_bvh(list.objects, time0, time1, build_settings) {}
+	flat_bvh(const vector<shared_ptr<hittable>>& src_objects, double time0, double time1, const bvh_build_settings& build_settings = bvh_build_settings());
+	// adopts a tree built over src_objects earlier, e.g. one loaded from a cache file;
+	// cost is its sah_cost() right after that build
+	flat_bvh(const vector<shared_ptr<hittable>>& src_objects, flat_bvh_tree&& prebuilt, double cost, const bvh_build_settings& build_settings = bvh_build_settings());
+
+	// Moves the tree to the shutter interval [time0, time1], for the next frame of an
+	// animation. Refits to the objects' new boxes and rebuilds when the SAH cost grew past
+	// max_cost_growth. Returns true if it rebuilt.
+	bool update(double time0, double time1);
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+	{
+		return hit(r, t_min, t_max, rec, no_traversal_stats());
+	}
+
+	// hit() counting the nodes and primitives it tests into stats
+	template<typename stats_type>
+	bool hit(const ray& r, double t_min, double t_max, hit_record& rec, stats_type&& stats) const
+	{
+		hit_candidate c;
+		if (!intersect(r, t_min, t_max, c, rec, stats))
+			return false;
+		c.resolve(r, rec);
+		return true;
+	}
+
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec) const override
+	{
+		return intersect(r, t_min, t_max, c, rec, no_traversal_stats());
+	}
+
+	template<typename stats_type>
+	bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec, stats_type&& stats) const
+	{
+		return tree.traverse(r, t_min, t_max, [&](uint32_t slot, double t0, double& t1)
+		{
+			if (!objects[slot]->intersect(r, t0, t1, c, rec))
+				return false;
+			t1 = c.t;
+			return true;
+		}, stats);
+	}
+
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override
+	{
+		return tree.traverse(r, t_min, t_max, [&](uint32_t slot, double t0, double& t1)
+		{
+			if (!objects[slot]->occluded(r, t0, t1))
+				return false;
+			t1 = -infinity; // ends the walk
+			return true;
+		});
+	}
+
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
+	{
+		output_box = box;
+		return !objects.empty();
+	}
+
+private:
+	void build(const vector<shared_ptr<hittable>>& src_objects, double time0, double time1);
+	void adopt_tree(const vector<shared_ptr<hittable>>& src_objects); // puts objects in leaf order
+};
+
+flat_bvh::flat_bvh(const vector<shared_ptr<hittable>>& src_objects, double time0, double time1, const bvh_build_settings& build_settings)
+	: settings(build_settings)
+{
+	build(src_objects, time0, time1);
+}
+
+flat_bvh::flat_bvh(const vector<shared_ptr<hittable>>& src_objects, flat_bvh_tree&& prebuilt, double cost, const bvh_build_settings& build_settings)
+	: tree(move(prebuilt)), settings(build_settings), built_cost(cost)
+{
+	adopt_tree(src_objects);
+}
+
+void flat_bvh::build(const vector<shared_ptr<hittable>>& src_objects, double time0, double time1)
+{
+	if (src_objects.empty())
+		return;
+
+	auto prims = gather_primitives(src_objects, 0, src_objects.size(), time0, time1);
+	tree.build(prims, settings);
+	adopt_tree(src_objects);
+	built_cost = tree.sah_cost(settings.traversal_cost);
+}
+
+void flat_bvh::adopt_tree(const vector<shared_ptr<hittable>>& src_objects)
+{
+	if (tree.nodes.empty())
+		return;
+
+	vector<shared_ptr<hittable>> ordered;
+	ordered.reserve(tree.indices.size());
+	for (auto index : tree.indices)
+		ordered.push_back(src_objects[index]);
+	objects.swap(ordered);
+
+	box = tree.nodes.begin()->box(); // const access, a mapped tree stays mapped
+}
+
+bool flat_bvh::update(double time0, double time1)
+{
+	if (objects.empty())
+		return false;
+
+	tree.refit([&](uint32_t slot)
+	{
+		aabb b;
+		objects[slot]->bounding_box(time0, time1, b);
+		return b;
+	});
+	box = tree.nodes[0].box();
+
+	if (tree.sah_cost(settings.traversal_cost) <= built_cost * max_cost_growth)
+		return false;
+
+	auto current = objects; // build() reorders objects from this copy
+	build(current, time0, time1);
+	return true;
+}
+#endif // !FLAT_BVH_H
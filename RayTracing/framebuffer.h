@@ -0,0 +1,155 @@
+#pragma once
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "vec3.h"
+#include "raytracing_stb_image_write.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FRAMEBUFFER_USE_SSE2
+#endif
+
+using namespace std;
+
+// Linear HDR image. Pixels are addressed like the render loop, j = 0 is the bottom
+// scanline, but stored top scanline first so LDR output is a straight copy.
+class framebuffer
+{
+public:
+	int width;
+	int height;
+	vector<float> data; // rgb triples
+
+	framebuffer(int w = 0, int h = 0) : width(w), height(h), data(size_t(w) * h * 3, 0.0f) {}
+
+	float* pixel(int i, int j)
+	{
+		return &data[(size_t(height - 1 - j) * width + i) * 3];
+	}
+
+	const float* pixel(int i, int j) const
+	{
+		return &data[(size_t(height - 1 - j) * width + i) * 3];
+	}
+
+	void set(int i, int j, const color& c)
+	{
+		auto p = pixel(i, j);
+		p[0] = float(c.x());
+		p[1] = float(c.y());
+		p[2] = float(c.z());
+	}
+
+	void add(int i, int j, const color& c)
+	{
+		auto p = pixel(i, j);
+		p[0] += float(c.x());
+		p[1] += float(c.y());
+		p[2] += float(c.z());
+	}
+
+	color get(int i, int j) const
+	{
+		auto p = pixel(i, j);
+		return color(p[0], p[1], p[2]);
+	}
+
+	// tone map with exposure and gamma 2 into 8-bit rgb, one pass over the whole buffer
+	vector<unsigned char> to_ldr(float exposure = 1.0f) const;
+
+	bool write_ppm(ostream& out, float exposure = 1.0f) const;
+	// format from the extension: .ppm (binary P6), .png, .pfm or .raw (bare floats)
+	bool write(const string& filename, float exposure = 1.0f) const;
+
+private:
+	bool write_pfm(const string& filename) const;
+};
+
+vector<unsigned char> framebuffer::to_ldr(float exposure) const
+{
+	vector<unsigned char> out(data.size());
+	size_t n = data.size();
+	size_t k = 0;
+
+#ifdef FRAMEBUFFER_USE_SSE2
+	const __m128 scale = _mm_set1_ps(exposure);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 limit = _mm_set1_ps(0.999f);
+	const __m128 levels = _mm_set1_ps(256.0f);
+	for (; k + 4 <= n; k += 4)
+	{
+		// max() also maps NaN to zero, like the scalar tail below
+		__m128 v = _mm_max_ps(_mm_mul_ps(_mm_loadu_ps(&data[k]), scale), zero);
+		v = _mm_min_ps(_mm_sqrt_ps(v), limit);
+		__m128i q = _mm_cvttps_epi32(_mm_mul_ps(v, levels));
+		q = _mm_packs_epi32(q, q);
+		q = _mm_packus_epi16(q, q);
+		int32_t packed = _mm_cvtsi128_si32(q);
+		memcpy(&out[k], &packed, 4);
+	}
+#endif
+
+	for (; k < n; ++k)
+	{
+		float v = data[k] * exposure;
+		v = v > 0.0f ? sqrtf(v) : 0.0f;
+		out[k] = static_cast<unsigned char>(256.0f * (v < 0.999f ? v : 0.999f));
+	}
+	return out;
+}
+
+bool framebuffer::write_ppm(ostream& out, float exposure) const
+{
+	auto ldr = to_ldr(exposure);
+	out << "P6\n" << width << ' ' << height << "\n255\n";
+	out.write(reinterpret_cast<const char*>(ldr.data()), ldr.size());
+	return bool(out);
+}
+
+bool framebuffer::write_pfm(const string& filename) const
+{
+	ofstream out(filename, ios::binary);
+	if (!out)
+		return false;
+
+	// PFM stores scanlines bottom to top; a negative scale means little endian
+	uint16_t probe = 1;
+	bool little_endian = *reinterpret_cast<unsigned char*>(&probe) == 1;
+	out << "PF\n" << width << ' ' << height << '\n' << (little_endian ? "-1.0" : "1.0") << '\n';
+	for (int j = 0; j < height; ++j)
+		out.write(reinterpret_cast<const char*>(pixel(0, j)), sizeof(float) * 3 * width);
+	return bool(out);
+}
+
+bool framebuffer::write(const string& filename, float exposure) const
+{
+	auto dot = filename.rfind('.');
+	string ext = dot == string::npos ? "" : filename.substr(dot + 1);
+
+	if (ext == "pfm")
+		return write_pfm(filename);
+
+	if (ext == "raw")
+	{
+		ofstream out(filename, ios::binary);
+		out.write(reinterpret_cast<const char*>(data.data()), sizeof(float) * data.size());
+		return bool(out);
+	}
+
+	if (ext == "png")
+	{
+		auto ldr = to_ldr(exposure);
+		return stbi_write_png(filename.c_str(), width, height, 3, ldr.data(), width * 3) != 0;
+	}
+
+	ofstream out(filename, ios::binary);
+	return out && write_ppm(out, exposure);
+}
+#endif // !FRAMEBUFFER_H
@@ -7,12 +7,13 @@
 #include "utils.h"
 
 class material;
+class hittable;
 
 struct hit_record
 {
     point3 pt;
     vec3 normal;
-    shared_ptr<material> mat_ptr;
+    const material* mat_ptr = nullptr; // owned by the primitive that was hit, so hits touch no reference count
     double t;
     double u;
     double v;
@@ -30,11 +31,44 @@ struct hit_record
     }
 };
 
+// Closest hit found so far by intersect(), before its attributes are computed.
+struct hit_candidate
+{
+    double t;
+    double u, v;                      // local coordinates on object, for objects that need them
+    uint32_t primitive;               // which part of object was hit, for objects made of many
+    const hittable* object = nullptr; // the object still to resolve(); null once rec is complete
+
+    // completes rec for the winner
+    void resolve(const ray& r, hit_record& rec) const;
+};
+
 class hittable
 {
 public:
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+    // Lean closest-hit test for traversal loops. Primitives that can defer their attributes
+    // record t, themselves and their local coordinates in c, and resolve() computes the rest
+    // for the final winner only. Other objects fill rec in full here and clear c.object.
+    // Either way c.t is set on a hit and nothing is written on a miss.
+    virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec) const
+    {
+        if (!hit(r, t_min, t_max, rec))
+            return false;
+        c.t = rec.t;
+        c.object = nullptr;
+        return true;
+    }
+    // fills rec for the hit intersect() recorded in c
+    virtual void resolve(const ray& r, const hit_candidate& c, hit_record& rec) const {}
+    // Any-hit query for shadow rays: true if anything blocks r within [t_min, t_max].
+    // Overrides return on the first hit they find and fill no hit_record.
+    virtual bool occluded(const ray& r, double t_min, double t_max) const
+    {
+        hit_record rec;
+        return hit(r, t_min, t_max, rec);
+    }
     virtual double pdf_value(const point3& o, const vec3& v) const
     {
         return 0.0;
@@ -49,6 +83,23 @@ public:
     }
 };
 
+void hit_candidate::resolve(const ray& r, hit_record& rec) const
+{
+    if (object)
+        object->resolve(r, *this, rec);
+}
+
+// hit() of objects that implement intersect(): the closest hit first, then the attributes
+// of that one hit
+inline bool hit_closest(const hittable& object, const ray& r, double t_min, double t_max, hit_record& rec)
+{
+    hit_candidate c;
+    if (!object.intersect(r, t_min, t_max, c, rec))
+        return false;
+    c.resolve(r, rec);
+    return true;
+}
+
 class translate : public hittable
 {
 public:
@@ -59,6 +110,10 @@ public:
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override
+    {
+        return ptr->occluded(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max);
+    }
 };
 
 bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
@@ -94,11 +149,31 @@ public:
 
     rotate_y(shared_ptr<hittable> p, double angle);
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override
+    {
+        return ptr->occluded(rotated(r), t_min, t_max);
+    }
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
     {
         output_box = bbox;
         return hasbox;
     }
+
+private:
+    // r in the object's frame
+    ray rotated(const ray& r) const
+    {
+        auto origin = r.origin();
+        auto direction = r.direction();
+
+        origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
+        origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
+
+        direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
+        direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
+
+        return ray(origin, direction, r.time());
+    }
 };
 
 rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p)
@@ -139,17 +214,7 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p)
 
 bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
-
-    auto origin = r.origin();
-    auto direction = r.direction();
-
-    origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2]; // ???
-    origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
-
-    direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
-    direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
-
-    ray rotated_r(origin, direction, r.time());
+    ray rotated_r = rotated(r);
 
     if (!ptr->hit(rotated_r, t_min, t_max, rec))
         return false;
@@ -185,6 +250,11 @@ public:
         return true;
     }
 
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override
+    {
+        return ptr->occluded(r, t_min, t_max);
+    }
+
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
     {
         return ptr->bounding_box(time0, time1, output_box);
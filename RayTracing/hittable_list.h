@@ -20,8 +20,21 @@ public:
 		add(object);
 	}
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+	{
+		return hit_closest(*this, r, t_min, t_max, rec);
+	}
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override
+	{
+		for (const auto& object : objects)
+		{
+			if (object->occluded(r, t_min, t_max))
+				return true;
+		}
+		return false;
+	}
 
 	void clear()
 	{
@@ -34,19 +47,17 @@ public:
 	}
 };
 
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool hittable_list::intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec) const
 {
-	hit_record temp_rec;
 	bool hit_anything = false;
 	auto closest_so_far = t_max;
 
 	for (const auto & object : objects)
 	{
-		if (object->hit(r, t_min, closest_so_far, temp_rec)) // find the closest hit point 
+		if (object->intersect(r, t_min, closest_so_far, c, rec)) // find the closest hit point 
 		{
 			hit_anything = true;
-			closest_so_far = temp_rec.t;
-			rec = temp_rec;
+			closest_so_far = c.t;
 		}
 	}
 	return hit_anything;
@@ -0,0 +1,254 @@
+#pragma once
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "accel.h"
+#include "flat_bvh.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+// Affine map x -> m * x + t, stored as a 3x4 matrix.
+struct affine_transform
+{
+	double m[3][4] = { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } };
+
+	static affine_transform translation(const vec3& offset)
+	{
+		affine_transform a;
+		for (int i = 0; i < 3; ++i)
+			a.m[i][3] = offset[i];
+		return a;
+	}
+
+	// same convention as rotate_y
+	static affine_transform rotation_y(double angle)
+	{
+		auto radians = degrees_to_radians(angle);
+		affine_transform a;
+		a.m[0][0] = cos(radians);
+		a.m[0][2] = sin(radians);
+		a.m[2][0] = -sin(radians);
+		a.m[2][2] = cos(radians);
+		return a;
+	}
+
+	static affine_transform scaling(const vec3& scale)
+	{
+		affine_transform a;
+		for (int i = 0; i < 3; ++i)
+			a.m[i][i] = scale[i];
+		return a;
+	}
+
+	point3 point(const point3& p) const
+	{
+		return point3(
+			m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+			m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+			m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+	}
+
+	vec3 vector(const vec3& v) const
+	{
+		return vec3(
+			m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+			m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+			m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+	}
+
+	// transpose of the linear part; applied by an inverse it maps normals forward
+	vec3 transposed_vector(const vec3& v) const
+	{
+		return vec3(
+			m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+			m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+			m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+	}
+
+	aabb box(const aabb& b) const
+	{
+		point3 lo(infinity, infinity, infinity);
+		point3 hi(-infinity, -infinity, -infinity);
+		for (int corner = 0; corner < 8; ++corner)
+		{
+			point3 p = point(point3(
+				corner & 1 ? b.max().x() : b.min().x(),
+				corner & 2 ? b.max().y() : b.min().y(),
+				corner & 4 ? b.max().z() : b.min().z()));
+			for (int c = 0; c < 3; ++c)
+			{
+				lo[c] = fmin(lo[c], p[c]);
+				hi[c] = fmax(hi[c], p[c]);
+			}
+		}
+		return aabb(lo, hi);
+	}
+
+	affine_transform inverse() const;
+};
+
+// a * b applies b first
+inline affine_transform operator*(const affine_transform& a, const affine_transform& b)
+{
+	affine_transform c;
+	for (int i = 0; i < 3; ++i)
+	{
+		for (int j = 0; j < 4; ++j)
+		{
+			c.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+			if (j == 3)
+				c.m[i][j] += a.m[i][3];
+		}
+	}
+	return c;
+}
+
+affine_transform affine_transform::inverse() const
+{
+	// inverse of the linear part from its cofactors, then -inverse * t
+	affine_transform r;
+	double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+		- m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+		+ m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	double inv_det = 1.0 / det;
+
+	r.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+	r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+	r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+	r.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+	r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+	r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+	r.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+	r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+	r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+	for (int i = 0; i < 3; ++i)
+		r.m[i][3] = -(r.m[i][0] * m[0][3] + r.m[i][1] * m[1][3] + r.m[i][2] * m[2][3]);
+	return r;
+}
+
+// One placement of a shared geometry. The inverse is kept so a ray is moved into object
+// space with one matrix product; the direction is not renormalized, so t is the same in
+// both spaces.
+struct instance
+{
+	affine_transform to_world;
+	affine_transform to_object;
+	aabb box;          // world space
+	uint32_t geometry; // index into instance_bvh::geometries
+};
+
+// Two-level acceleration structure. Every unique geometry gets its own bottom-level
+// structure once; instances only reference it and sit in a top-level flat_bvh_tree, so
+// N copies of a geometry cost one copy plus N instance records.
+class instance_bvh : public hittable
+{
+public:
+	vector<shared_ptr<hittable>> geometries;
+	vector<instance> instances; // leaf order after build()
+	flat_bvh_tree tree;
+	aabb box;
+
+	// returns the id to instance the geometry with; lists get an acceleration structure
+	uint32_t add_geometry(const hittable_list& list)
+	{
+		return add_geometry(make_scene_accel(list, 0, 1));
+	}
+
+	uint32_t add_geometry(shared_ptr<hittable> geometry)
+	{
+		geometries.push_back(geometry);
+		return uint32_t(geometries.size() - 1);
+	}
+
+	void add_instance(uint32_t geometry, const affine_transform& to_world);
+
+	// builds the top level; call after the last add_instance
+	void build(const bvh_build_settings& settings = bvh_build_settings());
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+	{
+		return hit(r, t_min, t_max, rec, no_traversal_stats());
+	}
+
+	// hit() counting the top-level nodes and instances it tests into stats
+	template<typename stats_type>
+	bool hit(const ray& r, double t_min, double t_max, hit_record& rec, stats_type&& stats) const;
+
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override
+	{
+		return tree.traverse(r, t_min, t_max, [&](uint32_t slot, double t0, double& t1)
+		{
+			const instance& inst = instances[slot];
+			ray local(inst.to_object.point(r.origin()), inst.to_object.vector(r.direction()), r.time());
+			if (!geometries[inst.geometry]->occluded(local, t0, t1))
+				return false;
+			t1 = -infinity; // ends the walk
+			return true;
+		});
+	}
+
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
+	{
+		output_box = box;
+		return !instances.empty();
+	}
+};
+
+void instance_bvh::add_instance(uint32_t geometry, const affine_transform& to_world)
+{
+	instance inst;
+	inst.to_world = to_world;
+	inst.to_object = to_world.inverse();
+	inst.geometry = geometry;
+
+	aabb local;
+	if (!geometries[geometry]->bounding_box(0, 1, local))
+		cerr << "No bounding box in instance_bvh::add_instance.\n";
+	inst.box = to_world.box(local);
+	instances.push_back(inst);
+}
+
+void instance_bvh::build(const bvh_build_settings& settings)
+{
+	if (instances.empty())
+		return;
+
+	vector<bvh_primitive> prims(instances.size());
+	for (size_t n = 0; n < instances.size(); ++n)
+		prims[n] = bvh_primitive{ instances[n].box, instances[n].box.centroid(), n };
+	tree.build(prims, settings);
+
+	vector<instance> ordered;
+	ordered.reserve(instances.size());
+	for (auto index : tree.indices)
+		ordered.push_back(instances[index]);
+	instances.swap(ordered);
+
+	box = tree.nodes[0].box();
+}
+
+template<typename stats_type>
+bool instance_bvh::hit(const ray& r, double t_min, double t_max, hit_record& rec, stats_type&& stats) const
+{
+	return tree.traverse(r, t_min, t_max, [&](uint32_t slot, double t0, double& t1)
+	{
+		const instance& inst = instances[slot];
+		ray local(inst.to_object.point(r.origin()), inst.to_object.vector(r.direction()), r.time());
+		if (!geometries[inst.geometry]->hit(local, t0, t1, rec))
+			return false;
+
+		// the normal already faces the local ray, and the inverse transpose keeps that
+		rec.pt = inst.to_world.point(rec.pt);
+		rec.normal = unit_vector(inst.to_object.transposed_vector(rec.normal));
+		t1 = rec.t;
+		return true;
+	}, stats);
+}
+#endif // !INSTANCE_H
@@ -0,0 +1,201 @@
+#pragma once
+#ifndef LAZY_BVH_H
+#define LAZY_BVH_H
+
+#include "bvh.h"
+#include "flat_bvh.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+// Node of a lazy_bvh. It starts as an unsplit range of primitives and is split by the
+// first ray that reaches it.
+struct lazy_bvh_node
+{
+	float bounds[2][3]; // rounded outward like flat_bvh_node
+	aabb box;
+	aabb centroid_bounds;
+	size_t first = 0; // primitives [first, first + count) of lazy_bvh::prims
+	size_t count = 0;
+	int depth = 0;
+	int axis = 0;
+
+	atomic<bool> expanded{ false };
+	once_flag expand_once;
+	bool leaf = false;                       // valid once expanded
+	unique_ptr<lazy_bvh_node> children[2];   // valid once expanded, null for leaves
+
+	lazy_bvh_node(const aabb& b, const aabb& centroids, size_t first_prim, size_t prim_count, int node_depth)
+		: box(b), centroid_bounds(centroids), first(first_prim), count(prim_count), depth(node_depth)
+	{
+		for (int a = 0; a < 3; ++a)
+		{
+			bounds[0][a] = round_down(b.min()[a]);
+			bounds[1][a] = round_up(b.max()[a]);
+		}
+	}
+};
+
+// BVH over hittables that is built while rendering. Construction only gathers the
+// primitive boxes; a node's range is split with the binned SAH, whatever builder the
+// settings name, the first time a ray reaches it. The first pixels come out almost at
+// once, and parts of the scene no ray reaches are never built. Concurrent rays reaching
+// the same unsplit node wait for one of them to split it instead of splitting it twice.
+class lazy_bvh : public hittable
+{
+public:
+	vector<shared_ptr<hittable>> objects;
+	aabb box;
+
+	lazy_bvh(const hittable_list& list, double time0, double time1, const bvh_build_settings& settings = bvh_build_settings())
+		: lazy_bvh(list.objects, time0, time1, settings) {}
+	lazy_bvh(const vector<shared_ptr<hittable>>& src_objects, double time0, double time1, const bvh_build_settings& settings = bvh_build_settings());
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+	{
+		return hit_closest(*this, r, t_min, t_max, rec);
+	}
+
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec) const override
+	{
+		return traverse(r, t_min, t_max, [&](size_t index, double t0, double& t1)
+		{
+			if (!objects[index]->intersect(r, t0, t1, c, rec))
+				return false;
+			t1 = c.t;
+			return true;
+		});
+	}
+
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override
+	{
+		return traverse(r, t_min, t_max, [&](size_t index, double t0, double& t1)
+		{
+			if (!objects[index]->occluded(r, t0, t1))
+				return false;
+			t1 = -infinity; // ends the walk
+			return true;
+		});
+	}
+
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
+	{
+		output_box = box;
+		return !objects.empty();
+	}
+
+	// nodes split so far, out of roughly 2 * objects.size() / max_leaf_size for a full tree
+	size_t expanded_nodes() const { return expanded_count.load(); }
+
+private:
+	// The builder partitions prims in place; the ranges of different nodes never overlap,
+	// so concurrent splits touch disjoint parts of it.
+	mutable vector<bvh_primitive> prims;
+	mutable sah_builder builder;
+	unique_ptr<lazy_bvh_node> root;
+	mutable atomic<size_t> expanded_count{ 0 };
+
+	// makes sure node is split; cheap once it is
+	void expand(lazy_bvh_node& node) const;
+	unique_ptr<lazy_bvh_node> make_node(size_t first, size_t count, int depth) const;
+
+	// Same contract as flat_bvh_tree::traverse, leaf is given the index into objects.
+	template<typename leaf_fn>
+	bool traverse(const ray& r, double t_min, double t_max, leaf_fn leaf) const;
+};
+
+lazy_bvh::lazy_bvh(const vector<shared_ptr<hittable>>& src_objects, double time0, double time1, const bvh_build_settings& settings)
+	: objects(src_objects), prims(gather_primitives(src_objects, 0, src_objects.size(), time0, time1)), builder(prims, settings)
+{
+	if (objects.empty())
+		return;
+
+	root = make_node(0, prims.size(), 0);
+	box = root->box;
+}
+
+unique_ptr<lazy_bvh_node> lazy_bvh::make_node(size_t first, size_t count, int depth) const
+{
+	aabb bounds, centroid_bounds;
+	builder.range_bounds(first, first + count, bounds, centroid_bounds);
+	return make_unique<lazy_bvh_node>(bounds, centroid_bounds, first, count, depth);
+}
+
+void lazy_bvh::expand(lazy_bvh_node& node) const
+{
+	if (node.expanded.load(memory_order_acquire))
+		return;
+
+	call_once(node.expand_once, [&]
+	{
+		size_t first = node.first;
+		size_t last = node.first + node.count;
+		size_t mid;
+		if (node.depth < builder.settings.max_depth || node.count <= builder.settings.max_leaf_size)
+			mid = builder.split(first, last, node.box, node.centroid_bounds, node.axis);
+		else
+			mid = builder.median_split(first, last, node.centroid_bounds, node.axis);
+
+		if (mid == first)
+			node.leaf = true;
+		else
+		{
+			node.children[0] = make_node(first, mid - first, node.depth + 1);
+			node.children[1] = make_node(mid, last - mid, node.depth + 1);
+		}
+		++expanded_count;
+		node.expanded.store(true, memory_order_release);
+	});
+}
+
+template<typename leaf_fn>
+bool lazy_bvh::traverse(const ray& r, double t_min, double t_max, leaf_fn leaf) const
+{
+	if (!root)
+		return false;
+
+	ray_box_setup setup(r);
+	lazy_bvh_node* stack[bvh_stack_size];
+	int stack_size = 0;
+	lazy_bvh_node* current = root.get();
+	bool hit_anything = false;
+
+	while (true)
+	{
+		if (setup.hit(current->bounds, t_min, t_max))
+		{
+			expand(*current);
+			if (current->leaf)
+			{
+				for (size_t n = current->first; n < current->first + current->count; ++n)
+				{
+					if (leaf(prims[n].index, t_min, t_max))
+					{
+						hit_anything = true;
+						if (t_max < t_min)
+							return true; // any-hit query done
+					}
+				}
+			}
+			else
+			{
+				// nearer child first
+				int first_child = setup.dir_is_neg[current->axis];
+				stack[stack_size++] = current->children[1 - first_child].get();
+				current = current->children[first_child].get();
+				continue;
+			}
+		}
+
+		if (stack_size == 0)
+			break;
+		current = stack[--stack_size];
+	}
+	return hit_anything;
+}
+#endif // !LAZY_BVH_H
@@ -1,6 +1,6 @@
 ﻿#include <iostream>
 #include "utils.h"
-#include "color.h"
+#include "framebuffer.h"
 #include "hittable_list.h"
 #include "sphere.h"
 #include "moving_sphere.h"
@@ -10,75 +10,123 @@
 #include "box.h"
 #include "constant_medium.h"
 #include "bvh.h"
+#include "accel.h"
+#include "instance.h"
+#include "bvh_cache.h"
+#include "bvh_report.h"
+#include "obj_loader.h"
+#include "mesh_file.h"
 #include "pdf.h"
 #include "photon_map.h"
 #include "nearest_photons.h"
+#include "tile_renderer.h"
+#include "adaptive_sampler.h"
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <GL/glut.h>
 #include <typeinfo>
+#include <cstring>
+#include <cstdlib>
+#include <thread>
+#include <chrono>
+#include <string>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 using namespace std;
 
 shared_ptr<PhotonMap> photon_map = make_shared<PhotonMap>(50000);
 
-// calculate the intersection of the ray and the hittable objects
-color ray_color(const ray& r, const color& background, const hittable& world, shared_ptr<hittable>& lights, int depth)
+struct path_settings
 {
-    hit_record rec;
-
-    if (depth <= 0)
-        return color(0, 0, 0);
-
-    if (!world.hit(r, 0.001, infinity, rec)) // find the nearest crosspoint
-        return background;
-
-    ray scattered;
-    color attenuation;
-    color emitted = rec.mat_ptr->emitted(rec, rec.u, rec.v, rec.pt);
-    double pdf;
-    color albedo;
-    bool is_reflected = false;
+    int max_depth = 5;
+    int rr_depth = 3;           // bounces before Russian roulette starts
+    double light_weight = 0.7;  // share of diffuse bounces sampled toward the lights
+};
 
+// calculate the radiance along a camera ray. The path is followed in a loop that carries the
+// throughput; after rr_depth bounces Russian roulette ends paths that can contribute little and
+// divides the survivors by their survival probability, which keeps the estimate unbiased.
+color ray_color(const ray& r_in, const color& background, const hittable& world, const hittable& lights, const path_settings& settings)
+{
+    const int max_depth = settings.max_depth;
+    color radiance(0, 0, 0);
+    color throughput(1, 1, 1);
+    ray r = r_in;
 
-    if (!rec.mat_ptr->scatter(r, rec, albedo, scattered, pdf, is_reflected)) // light emitting material: false
-        return emitted;
-    //auto on_light = point3(random_double(213, 343), 554, random_double(-332, -227));
-    //auto to_light = on_light - rec.pt;
-    //auto distance_squared = to_light.length_squared();
-    //to_light = unit_vector(to_light);
+    for (int depth = max_depth; depth > 0; --depth)
+    {
+        seed_bounce(depth);
 
-    //if (dot(to_light, rec.normal) < 0)
-        //return emitted;
+        hit_record rec;
+        if (!world.hit(r, 0.001, infinity, rec)) // find the nearest crosspoint
+        {
+            radiance += throughput * background;
+            break;
+        }
 
-    //double light_area = (double)(343 - 213) * (-227 + 332);
-    //auto light_cosine = fabs(to_light.y());
-    //if (light_cosine < 0.000001)
-        //return emitted;
+        ray scattered;
+        color emitted = rec.mat_ptr->emitted(rec, rec.u, rec.v, rec.pt);
+        double pdf;
+        color albedo;
+        bool is_reflected = false;
 
-    //pdf = distance_squared / (light_cosine * light_area);
-    //scattered = ray(rec.pt, to_light, r.time());
-    //cosine_pdf p(rec.normal);
-    //scattered = ray(rec.pt, p.generate(), r.time());
-    //pdf = p.value(scattered.direction());
-    //if (!is_reflected)
-    //    return photon_map->getIrradiance(rec.pt, rec.normal, 20, 100);
+        radiance += throughput * emitted;
 
-    if (!rec.mat_ptr->use_monte_carlo())
-        return emitted + albedo * ray_color(scattered, background, world, lights, depth - 1);
+        // roulette only after the emission of this vertex is counted: a segment sampled toward
+        // a light has low throughput exactly when it is about to pick up that light
+        if (max_depth - depth >= settings.rr_depth)
+        {
+            auto survive = fmin(fmax(throughput.x(), fmax(throughput.y(), throughput.z())), 0.95);
+            if (random_double() >= survive)
+                break;
+            throughput /= survive;
+        }
 
-    auto p0 = make_shared<hittable_pdf>(lights, rec.pt);
-    auto p1 = make_shared<cosine_pdf>(rec.normal);
-    mixture_pdf mixed_pdf(p0, p1);
+        if (!rec.mat_ptr->scatter(r, rec, albedo, scattered, pdf, is_reflected)) // light emitting material: false
+            break;
+        //auto on_light = point3(random_double(213, 343), 554, random_double(-332, -227));
+        //auto to_light = on_light - rec.pt;
+        //auto distance_squared = to_light.length_squared();
+        //to_light = unit_vector(to_light);
+
+        //if (dot(to_light, rec.normal) < 0)
+            //return emitted;
+
+        //double light_area = (double)(343 - 213) * (-227 + 332);
+        //auto light_cosine = fabs(to_light.y());
+        //if (light_cosine < 0.000001)
+            //return emitted;
+
+        //pdf = distance_squared / (light_cosine * light_area);
+        //scattered = ray(rec.pt, to_light, r.time());
+        //cosine_pdf p(rec.normal);
+        //scattered = ray(rec.pt, p.generate(), r.time());
+        //pdf = p.value(scattered.direction());
+        //if (!is_reflected)
+        //    return photon_map->getIrradiance(rec.pt, rec.normal, 20, 100);
+
+        if (!rec.mat_ptr->use_monte_carlo())
+            throughput = throughput * albedo;
+        else
+        {
+            auto mixed_pdf = make_mixture_pdf(hittable_pdf(lights, rec.pt), cosine_pdf(rec.normal), settings.light_weight);
 
-    //hittable_pdf light_pdf(lights, rec.pt);
-    scattered = ray(rec.pt, mixed_pdf.generate(), r.time());
-    pdf = mixed_pdf.value(scattered.direction());
+            //hittable_pdf light_pdf(lights, rec.pt);
+            scattered = ray(rec.pt, mixed_pdf.generate(), r.time());
+            pdf = mixed_pdf.value(scattered.direction());
+            if (pdf <= 0)
+                break;
 
+            throughput = throughput * albedo * rec.mat_ptr->scattering_pdf(r, rec, scattered) / pdf;
+        }
+        r = scattered;
+    }
 
-    return emitted + albedo * rec.mat_ptr->scattering_pdf(r, rec, scattered) * ray_color(scattered, background, world, lights, depth - 1) / pdf;
-    //return emitted + albedo * ray_color(scattered, background, world, lights, depth - 1);
+    return radiance;
 }
 
 void trace_photon(const ray& r, const hittable& world, int depth, float power_scale, shared_ptr<PhotonMap> photon_map)
@@ -240,16 +288,16 @@ hittable_list cornell_box()
 
     
 
-    shared_ptr<hittable> box1 = make_shared<box>(point3(0.0, 0.0, 0), point3(165.0, 330.0, 165.0), ground);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(130, 0, -500));
+    // the boxes are instances placed by one transform each, not translate(rotate_y(box))
+    auto boxes = make_shared<instance_bvh>();
+    auto box1 = boxes->add_geometry(make_shared<box>(point3(0.0, 0.0, 0), point3(165.0, 330.0, 165.0), ground));
+    boxes->add_instance(box1, affine_transform::translation(vec3(130, 0, -500)) * affine_transform::rotation_y(15));
     //objects.add(make_shared<constant_medium>(box1, 0.01, color(7, 7, 7)));
-    objects.add(box1);
 
-    shared_ptr<hittable> box2 = make_shared<box>(point3(0.0, 0.0, 0), point3(165.0, 165, 165.0), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(300, 0, -300));
-    objects.add(box2);
+    auto box2 = boxes->add_geometry(make_shared<box>(point3(0.0, 0.0, 0), point3(165.0, 165, 165.0), white));
+    boxes->add_instance(box2, affine_transform::translation(vec3(300, 0, -300)) * affine_transform::rotation_y(-18));
+    boxes->build();
+    objects.add(boxes);
     return objects;
 }
 
@@ -301,6 +349,134 @@ hittable_list final_scene()
     return objects;
 }
 
+// many small spheres in a cube, a stress test for the acceleration structures; with
+// motion > 0 every sphere moves that far in a random direction during the shutter
+hittable_list sphere_cloud(int count = 200000, double motion = 0)
+{
+    hittable_list objects;
+    objects.objects.reserve(count);
+
+    auto white = make_shared<lambertian>(color(0.73, 0.73, 0.73));
+    auto red = make_shared<lambertian>(color(0.65, 0.05, 0.05));
+    for (int n = 0; n < count; ++n)
+    {
+        point3 center(random_double(-10, 10), random_double(-10, 10), random_double(-10, 10));
+        auto radius = random_double(0.02, 0.08);
+        if (motion > 0)
+            objects.add(make_shared<moving_sphere>(center, center + motion * random_unit_vector(), 0.0, 1.0, radius, n % 8 ? white : red));
+        else
+            objects.add(make_shared<sphere>(center, radius, n % 8 ? white : red));
+    }
+
+    return objects;
+}
+
+// Builds every acceleration structure over world and traces the same rays through each:
+// one camera ray per pixel, then one diffuse bounce and one shadow ray from every camera
+// ray that hits. Runs on the calling thread only, so the numbers are per core.
+void benchmark_accels(const hittable_list& world, const camera& cam, int image_width, int image_height, const bvh_build_settings& build_settings)
+{
+    vector<ray> rays;
+    rays.reserve(size_t(image_width) * image_height * 2);
+    for (int j = 0; j < image_height; ++j)
+    {
+        for (int i = 0; i < image_width; ++i)
+        {
+            seed_sample(uint64_t(j) * image_width + i, 0);
+            rays.push_back(cam.get_ray(double(i + random_double()) / (image_width - 1), double(j + random_double()) / (image_height - 1)));
+        }
+    }
+
+    // shadow rays run from every camera hit to a random point of the scene's box and
+    // are tested over [0.001, 0.999] of that segment
+    aabb world_box;
+    world.bounding_box(0.0, 1.0, world_box);
+    vector<ray> shadow_rays;
+
+    size_t primary = rays.size();
+    auto reference = make_accel(world, accel_type::binary, 0.0, 1.0);
+    for (size_t k = 0; k < primary; ++k)
+    {
+        hit_record rec;
+        if (reference->hit(rays[k], 0.001, infinity, rec))
+        {
+            rays.push_back(ray(rec.pt, rec.normal + random_unit_vector(), rays[k].time()));
+            point3 target(random_double(world_box.min().x(), world_box.max().x()), random_double(world_box.min().y(), world_box.max().y()),
+                random_double(world_box.min().z(), world_box.max().z()));
+            shadow_rays.push_back(ray(rec.pt, target - rec.pt, rays[k].time()));
+        }
+    }
+
+    cerr << bvh_builder_name(build_settings.builder) << " builder, " << world.objects.size() << " objects, " << primary << " camera rays, " << rays.size() - primary << " bounce rays\n";
+
+    vector<accel_type> types = { accel_type::bvh_node, accel_type::binary, accel_type::bvh4, accel_type::bvh8, accel_type::bvh4q, accel_type::motion };
+    if (world.objects.size() <= 1000)
+        types.insert(types.begin(), accel_type::none);
+
+    for (auto type : types)
+    {
+        auto start = chrono::steady_clock::now();
+        auto accel = make_accel(world, type, 0.0, 1.0, build_settings);
+        auto built = chrono::steady_clock::now();
+
+        size_t hits = 0;
+        double t_sum = 0;
+        double seconds[2];
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            auto pass_start = chrono::steady_clock::now();
+            for (size_t k = pass ? primary : 0; k < (pass ? rays.size() : primary); ++k)
+            {
+                hit_record rec;
+                if (accel->hit(rays[k], 0.001, infinity, rec))
+                {
+                    ++hits;
+                    t_sum += rec.t;
+                }
+            }
+            seconds[pass] = chrono::duration<double>(chrono::steady_clock::now() - pass_start).count();
+        }
+
+        // the same shadow rays through hit() and through occluded(); the counts must agree
+        size_t blocked[2] = { 0, 0 };
+        double shadow_seconds[2];
+        for (int query = 0; query < 2; ++query)
+        {
+            auto query_start = chrono::steady_clock::now();
+            for (const auto& r : shadow_rays)
+            {
+                hit_record rec;
+                if (query ? accel->occluded(r, 0.001, 0.999) : accel->hit(r, 0.001, 0.999, rec))
+                    ++blocked[query];
+            }
+            shadow_seconds[query] = chrono::duration<double>(chrono::steady_clock::now() - query_start).count();
+        }
+
+        bvh_report report;
+        make_bvh_report(*accel, report);
+
+        auto build_ms = chrono::duration<double, milli>(built - start).count();
+        cerr << accel_name(type) << ": build " << build_ms << " ms (" << build_ms / (world.objects.size() * 1e-6) << " ms per million), "
+             << double(report.memory_bytes) / world.objects.size() << " bytes per object, camera "
+             << primary / seconds[0] * 1e-6 << " Mrays/s, bounce " << (rays.size() - primary) / seconds[1] * 1e-6
+             << " Mrays/s, " << hits << " hits, t sum " << t_sum << ", shadow hit() " << shadow_rays.size() / shadow_seconds[0] * 1e-6
+             << " / occluded() " << shadow_rays.size() / shadow_seconds[1] * 1e-6 << " Mrays/s, " << blocked[0] << " / " << blocked[1] << " blocked\n";
+    }
+}
+
+// output_file with the frame number before the extension, frame_000.ppm if none was given
+string frame_file_name(const string& output_file, int frame)
+{
+    char number[16];
+    snprintf(number, sizeof(number), "_%03d", frame);
+
+    string file = output_file.empty() ? "frame.ppm" : output_file;
+    auto dot = file.rfind('.');
+    if (dot == string::npos)
+        return file + number;
+    return file.substr(0, dot) + number + file.substr(dot);
+}
+
 void Initial()
 {
     glClearColor(1.0f, 1.0f, 1.0f, 1.0f);  //清屏颜色
@@ -420,7 +596,98 @@ int main(int argc, char** argv)
     auto aspect_ratio = 16.0 / 9.0;
     int image_width = 800;
     int samples_per_pixel = 100;
-    const int max_depth = 5;
+    path_settings path_options;
+    int num_threads = static_cast<int>(thread::hardware_concurrency());
+    int tile_size = 16;
+    int scene = 6;
+    int spp_override = 0;
+    bool adaptive = false;
+    adaptive_settings adaptive_options;
+    adaptive_options.max_spp = -1; // the scene's samples_per_pixel unless given
+    string spp_map_file = "spp_map.pgm";
+    string output_file; // binary PPM on stdout unless given
+    float exposure = 1.0f;
+    accel_type accel = accel_type::automatic;
+    bool bench_accel = false;
+    bvh_build_settings build_settings;
+    string bvh_cache_dir; // if set, the world's BVH is mapped from / saved to this directory
+    string bvh_report_file; // if set, the world's acceleration structure is described here as JSON
+    int report_rays = 0;    // camera rays the report traces to count node visits and primitive tests
+    int frames = 0; // > 0: render an animation, frame f with the shutter open over [f, f + 1] / frames
+    string obj_file;    // if set, this OBJ mesh is added to the scene
+    string mesh_file;   // same for a binary mesh file, mapped instead of parsed
+    string mesh_output; // if set, the loaded mesh is written here as a binary mesh file
+
+    for (int n = 1; n < argc; ++n)
+    {
+        bool has_value = n + 1 < argc;
+        if (strcmp(argv[n], "--threads") == 0 && has_value)
+            num_threads = atoi(argv[++n]);
+        else if (strcmp(argv[n], "--tile-size") == 0 && has_value)
+            tile_size = atoi(argv[++n]);
+        else if (strcmp(argv[n], "--scene") == 0 && has_value)
+            scene = atoi(argv[++n]);
+        else if (strcmp(argv[n], "--spp") == 0 && has_value)
+            spp_override = atoi(argv[++n]);
+        else if (strcmp(argv[n], "--max-depth") == 0 && has_value)
+            path_options.max_depth = atoi(argv[++n]);
+        else if (strcmp(argv[n], "--rr-depth") == 0 && has_value)
+            path_options.rr_depth = atoi(argv[++n]);
+        else if (strcmp(argv[n], "--light-weight") == 0 && has_value)
+            path_options.light_weight = clamp(atof(argv[++n]), 0.0, 1.0);
+        else if (strcmp(argv[n], "--adaptive") == 0)
+            adaptive = true;
+        else if (strcmp(argv[n], "--min-spp") == 0 && has_value)
+            adaptive_options.min_spp = atoi(argv[++n]);
+        else if (strcmp(argv[n], "--max-spp") == 0 && has_value)
+            adaptive_options.max_spp = atoi(argv[++n]);
+        else if (strcmp(argv[n], "--error") == 0 && has_value)
+            adaptive_options.relative_error = atof(argv[++n]);
+        else if (strcmp(argv[n], "--global-error") == 0 && has_value)
+            adaptive_options.global_error = atof(argv[++n]);
+        else if (strcmp(argv[n], "--spp-map") == 0 && has_value)
+            spp_map_file = argv[++n];
+        else if ((strcmp(argv[n], "-o") == 0 || strcmp(argv[n], "--output") == 0) && has_value)
+            output_file = argv[++n];
+        else if (strcmp(argv[n], "--exposure") == 0 && has_value)
+            exposure = float(atof(argv[++n]));
+        else if (strcmp(argv[n], "--accel") == 0 && has_value)
+        {
+            if (!parse_accel_type(argv[++n], accel))
+                cerr << "Unknown acceleration structure '" << argv[n] << "', use auto, none, bvh_node, binary, bvh4, bvh8, bvh4q, motion or lazy.\n";
+        }
+        else if (strcmp(argv[n], "--builder") == 0 && has_value)
+        {
+            if (!parse_bvh_builder(argv[++n], build_settings.builder))
+                cerr << "Unknown BVH builder '" << argv[n] << "', use sah, lbvh or sbvh.\n";
+        }
+        else if (strcmp(argv[n], "--morton-bits") == 0 && has_value)
+            build_settings.morton_bits = atoi(argv[++n]);
+        else if (strcmp(argv[n], "--sah-clusters") == 0 && has_value)
+            build_settings.sah_clusters = size_t(atol(argv[++n]));
+        else if (strcmp(argv[n], "--treelet-passes") == 0 && has_value)
+            build_settings.treelet_passes = atoi(argv[++n]);
+        else if (strcmp(argv[n], "--max-duplication") == 0 && has_value)
+            build_settings.max_duplication = atof(argv[++n]);
+        else if (strcmp(argv[n], "--bvh-cache") == 0 && has_value)
+            bvh_cache_dir = argv[++n];
+        else if (strcmp(argv[n], "--bvh-report") == 0 && has_value)
+            bvh_report_file = argv[++n];
+        else if (strcmp(argv[n], "--report-rays") == 0 && has_value)
+            report_rays = atoi(argv[++n]);
+        else if (strcmp(argv[n], "--frames") == 0 && has_value)
+            frames = atoi(argv[++n]);
+        else if (strcmp(argv[n], "--obj") == 0 && has_value)
+            obj_file = argv[++n];
+        else if (strcmp(argv[n], "--mesh") == 0 && has_value)
+            mesh_file = argv[++n];
+        else if (strcmp(argv[n], "--save-mesh") == 0 && has_value)
+            mesh_output = argv[++n];
+        else if (strcmp(argv[n], "--bench-accel") == 0)
+            bench_accel = true;
+    }
+    if (num_threads <= 0)
+        num_threads = 1;
 
     // World
     hittable_list world;
@@ -431,7 +698,7 @@ int main(int argc, char** argv)
     auto aperture = 0.0;
     color background(0, 0, 0);
 
-    switch (6) {
+    switch (scene) {
     case 1:
         world = random_scene();
         background = color(0.70, 0.80, 1.00);
@@ -496,18 +763,111 @@ int main(int argc, char** argv)
         lookat = point3(278, 278, 0);
         vfov = 40.0;
         break;
+
+    case 9:
+        world = sphere_cloud();
+        aspect_ratio = 1.0;
+        image_width = 600;
+        samples_per_pixel = 20;
+        background = color(0.70, 0.80, 1.00);
+        lookfrom = point3(0, 0, 30);
+        lookat = point3(0, 0, 0);
+        vfov = 40.0;
+        break;
+
+    case 10:
+        world = sphere_cloud(200000, 1.0);
+        aspect_ratio = 1.0;
+        image_width = 600;
+        samples_per_pixel = 20;
+        background = color(0.70, 0.80, 1.00);
+        lookfrom = point3(0, 0, 30);
+        lookat = point3(0, 0, 0);
+        vfov = 40.0;
+        break;
     }
     shared_ptr<hittable> lights = make_shared<xz_rect>(213, 343, -332, -227, 554, shared_ptr<material>());
 
+    if (!obj_file.empty() || !mesh_file.empty())
+    {
+        auto load_start = chrono::steady_clock::now();
+        auto mesh = make_shared<triangle_mesh>();
+        const string& file = mesh_file.empty() ? obj_file : mesh_file;
+        if (mesh_file.empty() ? load_obj(obj_file, *mesh) : load_mesh_file(mesh_file, *mesh, build_settings))
+        {
+            auto loaded = chrono::steady_clock::now();
+            if (mesh_file.empty())
+                mesh->build(build_settings);
+            mesh->mat_ptr = make_shared<lambertian>(color(0.73, 0.73, 0.73));
+            world.add(mesh);
+            cerr << file << ": " << mesh->triangle_count() << " triangles, " << (mesh_file.empty() ? "parsed" : "mapped") << " in "
+                 << chrono::duration<double, milli>(loaded - load_start).count() << " ms";
+            if (mesh_file.empty())
+                cerr << ", BVH built in " << chrono::duration<double, milli>(chrono::steady_clock::now() - loaded).count() << " ms";
+            cerr << ".\n";
+            if (!mesh_output.empty() && !save_mesh_file(mesh_output, *mesh))
+                cerr << "Could not write '" << mesh_output << "'.\n";
+        }
+        else
+            cerr << "Could not load '" << file << "'.\n";
+    }
+
+    if (spp_override > 0)
+        samples_per_pixel = spp_override;
+
     // Camera
 
     int image_height = static_cast<int>(image_width / aspect_ratio);
 
     camera cam(lookfrom, lookat, vec3(0, 1, 0), vfov, aspect_ratio, aperture, 10.0, 0.0, 1.0);
 
-    // Render
+    if (bench_accel)
+    {
+        benchmark_accels(world, cam, image_width, image_height, build_settings);
+        return 0;
+    }
+
+    auto accel_start = chrono::steady_clock::now();
+    treelet_totals treelet;
+    bvh_build_settings scene_settings = build_settings;
+    scene_settings.treelet_report = &treelet;
+    shared_ptr<hittable> scene_root;
+    if (bvh_cache_dir.empty())
+        scene_root = make_scene_accel(world, 0.0, 1.0, accel, scene_settings);
+    else
+    {
+        // the cache holds flat_bvh trees, whatever --accel asked for
+        bool loaded = false;
+        scene_root = make_cached_flat_bvh(world.objects, 0.0, 1.0, bvh_cache_dir, scene_settings, &loaded);
+        cerr << "BVH " << (loaded ? "mapped from cache" : "built and cached") << " in "
+             << chrono::duration<double, milli>(chrono::steady_clock::now() - accel_start).count() << " ms.\n";
+    }
+    if (treelet.trees > 0)
+        cerr << "Treelet optimization: SAH " << treelet.sah_before / treelet.trees << " -> " << treelet.sah_after / treelet.trees
+             << (treelet.trees > 1 ? " on average over " + to_string(treelet.trees) + " trees" : string()) << " in " << treelet.milliseconds << " ms.\n";
+
+    if (!bvh_report_file.empty())
+    {
+        bvh_report report;
+        if (make_bvh_report(*scene_root, report, build_settings.traversal_cost))
+        {
+            vector<ray> rays;
+            rays.reserve(report_rays);
+            for (int k = 0; k < report_rays; ++k)
+            {
+                seed_sample(uint64_t(k), 0);
+                rays.push_back(cam.get_ray(random_double(), random_double()));
+            }
+            trace_bvh_report(*scene_root, rays, report);
 
-    cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+            ofstream out(bvh_report_file);
+            report.write_json(out);
+        }
+        else
+            cerr << "No acceleration structure to report on, the scene is a plain list.\n";
+    }
+
+    // Render
 
     /*xz_rect photon_lights(213, 343, -332, -227, 554, shared_ptr<material>());
     vec3 origin, dir, power = vec3(27.0f, 27.0f, 27.0f);
@@ -523,23 +883,104 @@ int main(int argc, char** argv)
 
     //cerr << photon_map->photons.size() << endl;
 
-    for (int j = image_height - 1; j >= 0; --j)
+    auto sample_pixel = [&](int i, int j, int s)
     {
-        cerr << "\rScanlines remaining: " << j << ' ' << flush;
-        for (int i = 0; i < image_width; ++i)
+        seed_sample(uint64_t(j) * image_width + i, s);
+        auto u = double(i + random_double()) / (image_width - 1);
+        auto v = double(j + random_double()) / (image_height - 1);
+        ray r = cam.get_ray(u, v);
+        return ray_color(r, background, *scene_root, *lights, path_options);
+    };
+
+    tile_renderer renderer(image_width, image_height, num_threads, tile_size);
+    auto start = chrono::steady_clock::now();
+
+    auto render_fixed = [&]()
+    {
+        renderer.render([&](int i, int j)
         {
             color pixel_color(0, 0, 0);
             for (int s = 0; s < samples_per_pixel; ++s)
+                pixel_color += sample_pixel(i, j, s);
+            return pixel_color / samples_per_pixel;
+        });
+    };
+
+    if (frames > 0)
+    {
+        // one tree for the whole animation, refit to every frame's shutter interval and
+        // rebuilt only when refitting has made it too slow
+        auto build_start = chrono::steady_clock::now();
+        auto animated = make_shared<flat_bvh>(world, 0.0, 1.0 / frames, build_settings);
+        auto build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - build_start).count();
+        scene_root = animated;
+
+        for (int f = 0; f < frames; ++f)
+        {
+            double time0 = double(f) / frames;
+            double time1 = double(f + 1) / frames;
+            auto update_start = chrono::steady_clock::now();
+            bool rebuilt = f > 0 && animated->update(time0, time1);
+            auto update_ms = f == 0 ? build_ms : chrono::duration<double, milli>(chrono::steady_clock::now() - update_start).count();
+
+            cam = camera(lookfrom, lookat, vec3(0, 1, 0), vfov, aspect_ratio, aperture, 10.0, time0, time1);
+            render_fixed();
+
+            auto file = frame_file_name(output_file, f);
+            if (!renderer.image.write(file, exposure))
+                cerr << "\nCould not write image '" << file << "'.\n";
+            cerr << "\nFrame " << f << ": " << (f == 0 ? "built" : rebuilt ? "rebuilt" : "refit") << " in " << update_ms << " ms, wrote " << file;
+        }
+
+        cerr << "\nDone in " << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s.\n";
+        return 0;
+    }
+
+    if (!adaptive)
+        render_fixed();
+    else
+    {
+        if (adaptive_options.max_spp <= 0)
+            adaptive_options.max_spp = samples_per_pixel;
+        adaptive_options.min_spp = max(2, min(adaptive_options.min_spp, adaptive_options.max_spp));
+        adaptive_sampler sampler(image_width, image_height, adaptive_options);
+
+        // a first pass at min_spp gives every pixel a variance estimate and the image mean
+        // for the global target; the second pass keeps sampling until each pixel converges
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            renderer.render([&](int i, int j)
             {
-                auto u = double(i + random_double()) / (image_width - 1);
-                auto v = double(j + random_double()) / (image_height - 1);
-                ray r = cam.get_ray(u, v);
-                pixel_color += ray_color(r, background, world, lights, max_depth);
-            }
-            write_color(cout, pixel_color, samples_per_pixel);
+                auto& p = sampler.pixel(i, j);
+                while (pass == 0 ? p.n < adaptive_options.min_spp : !sampler.converged(p))
+                    p.add(sample_pixel(i, j, p.n));
+                return p.sum / p.n;
+            });
+            sampler.update_tolerance();
         }
+
+        auto total = sampler.total_samples();
+        auto fixed = double(adaptive_options.max_spp) * image_width * image_height;
+        cerr << "\nAdaptive: " << double(total) / (double(image_width) * image_height) << " spp on average, "
+             << total << " of " << fixed << " samples (" << 100.0 * (1.0 - total / fixed) << "% saved)";
+        if (!sampler.write_spp_map(spp_map_file))
+            cerr << "Could not write spp map '" << spp_map_file << "'.\n";
     }
 
+    if (output_file.empty())
+    {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        renderer.image.write_ppm(cout, exposure);
+    }
+    else if (!renderer.image.write(output_file, exposure))
+        cerr << "\nCould not write image '" << output_file << "'.\n";
+
+    cerr << "\nDone in " << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s.\n";
+    if (auto lazy = dynamic_pointer_cast<lazy_bvh>(scene_root))
+        cerr << "Lazy BVH split " << lazy->expanded_nodes() << " nodes over " << lazy->objects.size() << " objects.\n";
+
     //shared_ptr<PhotonMap> photon_map = make_shared<PhotonMap>(10000);
 
     
@@ -0,0 +1,104 @@
+#pragma once
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Whole file mapped read-only, unmapped on destruction. The platform code is in
+// mapped_file.cpp, so that no header pulls in <windows.h> and its near/far macros.
+class mapped_file
+{
+public:
+	mapped_file() {}
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+	~mapped_file() { close(); }
+
+	bool open(const string& filename);
+	void close();
+
+	const unsigned char* data() const { return bytes; }
+	size_t size() const { return length; }
+
+private:
+	const unsigned char* bytes = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	void* file = nullptr;    // HANDLE
+	void* mapping = nullptr; // HANDLE
+#endif
+};
+
+// Array that either owns its elements in a vector or views read-only memory, such as a
+// mapped file, kept alive by owner. Non-const access copies a view into an owned array
+// first, so a mapped tree can still be modified, e.g. refit.
+template<typename T>
+class mappable_vector
+{
+public:
+	size_t size() const { return view ? view_size : owned.size(); }
+	bool empty() const { return size() == 0; }
+	bool is_mapped() const { return view != nullptr; }
+
+	const T* data() const { return view ? view : owned.data(); }
+	const T* begin() const { return data(); }
+	const T* end() const { return data() + size(); }
+
+	const T& operator[](size_t n) const { return data()[n]; }
+	T& operator[](size_t n)
+	{
+		make_owned();
+		return owned[n];
+	}
+
+	void clear()
+	{
+		owned.clear();
+		unmap();
+	}
+
+	void assign(vector<T>&& values)
+	{
+		unmap();
+		owned = move(values);
+	}
+
+	void push_back(const T& value) { owned.push_back(value); }
+	void emplace_back() { owned.emplace_back(); }
+	void reserve(size_t n) { owned.reserve(n); }
+
+	void map(const T* elements, size_t count, shared_ptr<const void> keep_alive)
+	{
+		owned.clear();
+		view = elements;
+		view_size = count;
+		owner = keep_alive;
+	}
+
+	void make_owned()
+	{
+		if (!view)
+			return;
+		owned.assign(view, view + view_size);
+		unmap();
+	}
+
+private:
+	vector<T> owned;
+	const T* view = nullptr;
+	size_t view_size = 0;
+	shared_ptr<const void> owner;
+
+	void unmap()
+	{
+		view = nullptr;
+		view_size = 0;
+		owner.reset();
+	}
+};
+#endif // !MAPPED_FILE_H
@@ -0,0 +1,215 @@
+#pragma once
+#ifndef MESH_FILE_H
+#define MESH_FILE_H
+
+#include "triangle_mesh.h"
+#include "bvh_cache.h"
+#include "mapped_file.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+using namespace std;
+
+// Binary mesh file: this header followed by every triangle_mesh buffer, each at a 64-byte
+// aligned offset, so a mapped file is intersected in place. The buffers are stored in the
+// mesh's leaf order, and the BVH nodes follow them unless the file was saved without.
+enum mesh_file_array
+{
+	mesh_position_x, mesh_position_y, mesh_position_z,
+	mesh_normal_x, mesh_normal_y, mesh_normal_z,
+	mesh_uv_u, mesh_uv_v,
+	mesh_vertex_index_0, mesh_vertex_index_1, mesh_vertex_index_2,
+	mesh_normal_index_0, mesh_normal_index_1, mesh_normal_index_2,
+	mesh_uv_index_0, mesh_uv_index_1, mesh_uv_index_2,
+	mesh_bvh_nodes,
+	mesh_file_array_count
+};
+
+struct mesh_file_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t node_size; // sizeof(flat_bvh_node), as in bvh_cache_header
+	uint64_t triangle_count;
+	uint64_t vertex_count;
+	double box[2][3];   // mesh bounds, valid with the nodes
+	uint64_t offset[mesh_file_array_count];
+	uint64_t count[mesh_file_array_count]; // elements; 0 for a buffer the mesh does not have
+};
+
+const char mesh_file_magic[8] = { 'R', 'T', 'M', 'E', 'S', 'H', 0, 0 };
+const uint32_t mesh_file_version = 1;
+
+namespace mesh_file_detail
+{
+	// Calls fn(array, buffer) for every buffer of the mesh, in mesh_file_array order.
+	template<typename mesh_type, typename fn_type>
+	void for_each_float_array(mesh_type& mesh, fn_type fn)
+	{
+		for (int a = 0; a < 3; ++a)
+			fn(mesh_position_x + a, mesh.position[a]);
+		for (int a = 0; a < 3; ++a)
+			fn(mesh_normal_x + a, mesh.normal[a]);
+		for (int a = 0; a < 2; ++a)
+			fn(mesh_uv_u + a, mesh.uv[a]);
+	}
+
+	template<typename mesh_type, typename fn_type>
+	void for_each_index_array(mesh_type& mesh, fn_type fn)
+	{
+		for (int k = 0; k < 3; ++k)
+			fn(mesh_vertex_index_0 + k, mesh.vertex_index[k]);
+		for (int k = 0; k < 3; ++k)
+			fn(mesh_normal_index_0 + k, mesh.normal_index[k]);
+		for (int k = 0; k < 3; ++k)
+			fn(mesh_uv_index_0 + k, mesh.uv_index[k]);
+	}
+
+	// first array of the group array belongs to: the x, y, z of one attribute, or the
+	// three corners of one index buffer
+	inline int group_start(int array)
+	{
+		if (array >= mesh_bvh_nodes)
+			return array;
+		if (array >= mesh_vertex_index_0)
+			return mesh_vertex_index_0 + (array - mesh_vertex_index_0) / 3 * 3;
+		if (array >= mesh_uv_u)
+			return mesh_uv_u;
+		return array >= mesh_normal_x ? mesh_normal_x : mesh_position_x;
+	}
+
+	template<typename T>
+	void map_array(mappable_vector<T>& buffer, const unsigned char* bytes, uint64_t count, const shared_ptr<mapped_file>& file)
+	{
+		buffer.map(reinterpret_cast<const T*>(bytes), size_t(count), file);
+	}
+
+	inline size_t element_size(int array)
+	{
+		if (array == mesh_bvh_nodes)
+			return sizeof(flat_bvh_node);
+		return array < mesh_vertex_index_0 ? sizeof(float) : sizeof(uint32_t);
+	}
+}
+
+// Writes mesh, which must have been built, to filename. with_bvh = false leaves the nodes
+// out; the loader then rebuilds the tree, which costs a build but keeps the file smaller.
+// Writes to a temporary file first and renames it, as save_bvh_cache does.
+inline bool save_mesh_file(const string& filename, const triangle_mesh& mesh, bool with_bvh = true)
+{
+	using namespace mesh_file_detail;
+
+	const void* data[mesh_file_array_count];
+	mesh_file_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, mesh_file_magic, sizeof(header.magic));
+	header.version = mesh_file_version;
+	header.node_size = sizeof(flat_bvh_node);
+	header.triangle_count = mesh.triangle_count();
+	header.vertex_count = mesh.vertex_count();
+	for (int a = 0; a < 3; ++a)
+	{
+		header.box[0][a] = mesh.box.min()[a];
+		header.box[1][a] = mesh.box.max()[a];
+	}
+
+	auto add = [&](int array, const auto& buffer)
+	{
+		data[array] = buffer.data();
+		header.count[array] = buffer.size();
+	};
+	for_each_float_array(mesh, add);
+	for_each_index_array(mesh, add);
+	data[mesh_bvh_nodes] = mesh.tree.nodes.data();
+	header.count[mesh_bvh_nodes] = with_bvh ? mesh.tree.nodes.size() : 0;
+
+	uint64_t end = sizeof(header);
+	for (int array = 0; array < mesh_file_array_count; ++array)
+	{
+		header.offset[array] = align_cache_offset(end);
+		end = header.offset[array] + header.count[array] * element_size(array);
+	}
+
+	string temporary = filename + ".tmp";
+	{
+		ofstream out(temporary, ios::binary);
+		const char zeros[64] = {};
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		uint64_t written = sizeof(header);
+		for (int array = 0; array < mesh_file_array_count; ++array)
+		{
+			out.write(zeros, header.offset[array] - written);
+			out.write(static_cast<const char*>(data[array]), header.count[array] * element_size(array));
+			written = header.offset[array] + header.count[array] * element_size(array);
+		}
+		if (!out)
+			return false;
+	}
+
+	remove(filename.c_str()); // rename does not replace an existing file on Windows
+	return rename(temporary.c_str(), filename.c_str()) == 0;
+}
+
+// Maps filename and points every buffer of mesh into it, without copying or parsing. Only
+// the layout is checked, not the indices, so the file must come from save_mesh_file. A
+// file without nodes gets its BVH built here, which copies the index buffers. Fails and
+// leaves mesh alone if the file is missing, truncated or from another version.
+inline bool load_mesh_file(const string& filename, triangle_mesh& mesh, const bvh_build_settings& settings = bvh_build_settings())
+{
+	using namespace mesh_file_detail;
+
+	auto file = make_shared<mapped_file>();
+	if (!file->open(filename) || file->size() < sizeof(mesh_file_header))
+		return false;
+
+	mesh_file_header header;
+	memcpy(&header, file->data(), sizeof(header));
+	if (memcmp(header.magic, mesh_file_magic, sizeof(header.magic)) != 0 || header.version != mesh_file_version
+		|| header.node_size != sizeof(flat_bvh_node) || header.triangle_count >= triangle_mesh::no_index
+		|| header.vertex_count >= triangle_mesh::no_index)
+		return false;
+
+	for (int array = 0; array < mesh_file_array_count; ++array)
+	{
+		if (header.offset[array] % 64 || header.offset[array] > file->size()
+			|| header.count[array] > (file->size() - header.offset[array]) / element_size(array))
+			return false;
+
+		// a buffer is as long as the others of its group; positions have one entry per
+		// vertex and index buffers one per triangle, or none for normals and uvs
+		int first = group_start(array);
+		uint64_t expected = array != first ? header.count[first]
+			: first == mesh_position_x ? header.vertex_count
+			: first >= mesh_vertex_index_0 && first < mesh_bvh_nodes ? header.triangle_count
+			: header.count[array];
+		bool required = first == mesh_position_x || first == mesh_vertex_index_0;
+		if (header.count[array] != expected && (required || array != first || header.count[array] != 0))
+			return false;
+	}
+	// attribute indices need the attributes they index
+	if ((header.count[mesh_normal_index_0] != 0 && header.count[mesh_normal_x] == 0)
+		|| (header.count[mesh_uv_index_0] != 0 && header.count[mesh_uv_u] == 0))
+		return false;
+
+	auto map = [&](int array, auto& buffer)
+	{
+		map_array(buffer, file->data() + header.offset[array], header.count[array], file);
+	};
+	for_each_float_array(mesh, map);
+	for_each_index_array(mesh, map);
+
+	if (header.count[mesh_bvh_nodes] == 0)
+	{
+		mesh.build(settings);
+		return true;
+	}
+	mesh.tree = flat_bvh_tree();
+	map_array(mesh.tree.nodes, file->data() + header.offset[mesh_bvh_nodes], header.count[mesh_bvh_nodes], file);
+	mesh.box = aabb(point3(header.box[0][0], header.box[0][1], header.box[0][2]), point3(header.box[1][0], header.box[1][1], header.box[1][2]));
+	return true;
+}
+#endif // !MESH_FILE_H
@@ -0,0 +1,331 @@
+#pragma once
+#ifndef MOTION_BVH_H
+#define MOTION_BVH_H
+
+#include "flat_bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// flat_bvh_node with one box at shutter open and one at shutter close. Objects in this
+// renderer move linearly over the shutter, and so does every corner of the union of
+// their boxes, so the box at any time is the interpolation of the two keys.
+struct motion_bvh_node
+{
+	float bounds[2][2][3]; // [open, close][min, max][axis]
+	uint32_t offset;       // interior: index of the second child; leaf: first primitive slot
+	uint16_t count;        // number of primitives of a leaf, 0 for interior nodes
+	uint8_t axis;
+	uint8_t pad;
+
+	bool is_leaf() const { return count > 0; }
+};
+
+static_assert(sizeof(motion_bvh_node) == 56, "motion_bvh_node should stay 56 bytes");
+
+class motion_bvh_tree
+{
+public:
+	vector<motion_bvh_node> nodes;
+	vector<uint32_t> indices; // slot -> index into the primitive array handed to build()
+	double time0 = 0;
+	double time1 = 1;
+
+	// prims carry the boxes swept over the shutter and decide the topology; open_boxes
+	// and close_boxes are the boxes at time0 and time1, indexed like the prims before build
+	void build(vector<bvh_primitive>& prims, const vector<aabb>& open_boxes, const vector<aabb>& close_boxes,
+		double t0, double t1, const bvh_build_settings& settings = bvh_build_settings());
+
+	// same contract as flat_bvh_tree::traverse, with the node boxes taken at r.time()
+	template<typename leaf_fn, typename stats_type = no_traversal_stats>
+	bool traverse(const ray& r, double t_min, double t_max, leaf_fn leaf, stats_type&& stats = stats_type()) const;
+
+private:
+	uint32_t flatten_node(const bvh_build_node& node, const vector<bvh_primitive>& prims, const vector<aabb>& open_boxes, const vector<aabb>& close_boxes);
+};
+
+void motion_bvh_tree::build(vector<bvh_primitive>& prims, const vector<aabb>& open_boxes, const vector<aabb>& close_boxes,
+	double t0, double t1, const bvh_build_settings& settings)
+{
+	time0 = t0;
+	time1 = t1;
+	nodes.clear();
+	indices.clear();
+	if (prims.empty())
+		return;
+
+	auto root = build_bvh(prims, settings);
+	flatten_node(*root, prims, open_boxes, close_boxes);
+}
+
+uint32_t motion_bvh_tree::flatten_node(const bvh_build_node& node, const vector<bvh_primitive>& prims, const vector<aabb>& open_boxes, const vector<aabb>& close_boxes)
+{
+	uint32_t index = uint32_t(nodes.size());
+	nodes.emplace_back();
+
+	motion_bvh_node flat;
+	flat.axis = uint8_t(node.axis);
+	flat.pad = 0;
+
+	aabb keys[2];
+	if (node.is_leaf())
+	{
+		flat.offset = uint32_t(indices.size());
+		flat.count = uint16_t(node.count);
+		keys[0] = open_boxes[prims[node.first].index];
+		keys[1] = close_boxes[prims[node.first].index];
+		for (size_t n = node.first; n < node.first + node.count; ++n)
+		{
+			indices.push_back(uint32_t(prims[n].index));
+			keys[0] = surrounding_box(keys[0], open_boxes[prims[n].index]);
+			keys[1] = surrounding_box(keys[1], close_boxes[prims[n].index]);
+		}
+		for (int k = 0; k < 2; ++k)
+		{
+			for (int a = 0; a < 3; ++a)
+			{
+				flat.bounds[k][0][a] = round_down(keys[k].min()[a]);
+				flat.bounds[k][1][a] = round_up(keys[k].max()[a]);
+			}
+		}
+	}
+	else
+	{
+		flat.count = 0;
+		uint32_t left = flatten_node(*node.children[0], prims, open_boxes, close_boxes);
+		flat.offset = flatten_node(*node.children[1], prims, open_boxes, close_boxes);
+		for (int k = 0; k < 2; ++k)
+		{
+			for (int a = 0; a < 3; ++a)
+			{
+				flat.bounds[k][0][a] = min(nodes[left].bounds[k][0][a], nodes[flat.offset].bounds[k][0][a]);
+				flat.bounds[k][1][a] = max(nodes[left].bounds[k][1][a], nodes[flat.offset].bounds[k][1][a]);
+			}
+		}
+	}
+
+	nodes[index] = flat;
+	return index;
+}
+
+template<typename leaf_fn, typename stats_type>
+bool motion_bvh_tree::traverse(const ray& r, double t_min, double t_max, leaf_fn leaf, stats_type&& stats) const
+{
+	if (nodes.empty())
+		return false;
+
+	ray_box_setup setup(r);
+	double u = time1 > time0 ? clamp((r.time() - time0) / (time1 - time0), 0.0, 1.0) : 0.0;
+
+	auto hit_node = [&](const motion_bvh_node& node)
+	{
+		double t0 = t_min;
+		double t1 = t_max;
+		for (int a = 0; a < 3; ++a)
+		{
+			int lo_side = setup.dir_is_neg[a];
+			double lo = node.bounds[0][lo_side][a] + u * (double(node.bounds[1][lo_side][a]) - node.bounds[0][lo_side][a]);
+			double hi = node.bounds[0][1 - lo_side][a] + u * (double(node.bounds[1][1 - lo_side][a]) - node.bounds[0][1 - lo_side][a]);
+			double slab0 = (lo - setup.origin[a]) * setup.inv_dir[a];
+			double slab1 = (hi - setup.origin[a]) * setup.inv_dir[a];
+			t0 = slab0 > t0 ? slab0 : t0;
+			t1 = slab1 < t1 ? slab1 : t1;
+			if (t1 < t0)
+				return false;
+		}
+		return true;
+	};
+
+	uint32_t stack[bvh_stack_size];
+	int stack_size = 0;
+	uint32_t current = 0;
+	bool hit_anything = false;
+
+	while (true)
+	{
+		const motion_bvh_node& node = nodes[current];
+		stats.visit_node();
+		if (hit_node(node))
+		{
+			if (node.is_leaf())
+			{
+				for (uint32_t slot = node.offset; slot < node.offset + node.count; ++slot)
+				{
+					stats.test_primitive();
+					if (leaf(slot, t_min, t_max))
+					{
+						hit_anything = true;
+						if (t_max < t_min)
+							return true; // any-hit query done
+					}
+				}
+			}
+			else if (setup.dir_is_neg[node.axis])
+			{
+				stack[stack_size++] = current + 1;
+				current = node.offset;
+				continue;
+			}
+			else
+			{
+				stack[stack_size++] = node.offset;
+				current = current + 1;
+				continue;
+			}
+		}
+
+		if (stack_size == 0)
+			break;
+		current = stack[--stack_size];
+	}
+	return hit_anything;
+}
+
+// How far objects move during [time0, time1], relative to their size: the summed
+// distance between the box centers at time0 and time1 over the summed box diagonals.
+inline double motion_ratio(const vector<shared_ptr<hittable>>& objects, double time0, double time1)
+{
+	double motion = 0;
+	double size = 0;
+	for (const auto& object : objects)
+	{
+		aabb open, close;
+		if (!object->bounding_box(time0, time0, open) || !object->bounding_box(time1, time1, close))
+			continue;
+		motion += (close.centroid() - open.centroid()).length();
+		size += (open.max() - open.min()).length();
+	}
+	return size > 0 ? motion / size : 0;
+}
+
+// BVH over hittables for motion blur. Rays only test the boxes the objects occupy at
+// the ray's time, not the boxes swept over the whole shutter. The shutter is split into
+// segments with a tree each, so objects that move far relative to their size and to
+// each other still get tight boxes: every tree only covers the motion of its segment.
+class motion_bvh : public hittable
+{
+public:
+	vector<shared_ptr<hittable>> objects;
+	vector<motion_bvh_tree> segments; // leaf slots map through tree.indices into objects
+	double time0 = 0;
+	double time1 = 1;
+	aabb box; // swept over the shutter
+
+	motion_bvh(const hittable_list& list, double t0, double t1, const bvh_build_settings& settings = bvh_build_settings(), int segment_count = 0)
+		: motion_bvh(list.objects, t0, t1, settings, segment_count) {}
+	// segment_count 0 picks one from how far the objects move, see choose_segments()
+	motion_bvh(const vector<shared_ptr<hittable>>& src_objects, double t0, double t1, const bvh_build_settings& settings = bvh_build_settings(), int segment_count = 0);
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+	{
+		return hit(r, t_min, t_max, rec, no_traversal_stats());
+	}
+
+	// hit() counting the nodes and primitives it tests into stats
+	template<typename stats_type>
+	bool hit(const ray& r, double t_min, double t_max, hit_record& rec, stats_type&& stats) const
+	{
+		hit_candidate c;
+		if (!intersect(r, t_min, t_max, c, rec, stats))
+			return false;
+		c.resolve(r, rec);
+		return true;
+	}
+
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec) const override
+	{
+		return intersect(r, t_min, t_max, c, rec, no_traversal_stats());
+	}
+
+	template<typename stats_type>
+	bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec, stats_type&& stats) const
+	{
+		if (segments.empty())
+			return false;
+
+		const motion_bvh_tree& tree = segment_at(r.time());
+		return tree.traverse(r, t_min, t_max, [&](uint32_t slot, double t0, double& t1)
+		{
+			if (!objects[tree.indices[slot]]->intersect(r, t0, t1, c, rec))
+				return false;
+			t1 = c.t;
+			return true;
+		}, stats);
+	}
+
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override
+	{
+		if (segments.empty())
+			return false;
+
+		const motion_bvh_tree& tree = segment_at(r.time());
+		return tree.traverse(r, t_min, t_max, [&](uint32_t slot, double t0, double& t1)
+		{
+			if (!objects[tree.indices[slot]]->occluded(r, t0, t1))
+				return false;
+			t1 = -infinity; // ends the walk
+			return true;
+		});
+	}
+
+	virtual bool bounding_box(double t0, double t1, aabb& output_box) const override
+	{
+		output_box = box;
+		return !objects.empty();
+	}
+
+	static int choose_segments(const vector<shared_ptr<hittable>>& objects, double t0, double t1);
+
+private:
+	// the segment whose time interval holds time
+	const motion_bvh_tree& segment_at(double time) const
+	{
+		double u = time1 > time0 ? (time - time0) / (time1 - time0) : 0.0;
+		int k = int(clamp(u * segments.size(), 0.0, double(segments.size() - 1)));
+		return segments[k];
+	}
+};
+
+// Enough segments that objects move about their own size per segment. More than 8
+// stopped paying off for 200k spheres: the extra trees cost more in cache than they save.
+int motion_bvh::choose_segments(const vector<shared_ptr<hittable>>& objects, double t0, double t1)
+{
+	return int(clamp(ceil(motion_ratio(objects, t0, t1)), 1.0, 8.0));
+}
+
+motion_bvh::motion_bvh(const vector<shared_ptr<hittable>>& src_objects, double t0, double t1, const bvh_build_settings& settings, int segment_count)
+	: objects(src_objects), time0(t0), time1(t1)
+{
+	if (objects.empty())
+		return;
+	if (segment_count <= 0)
+		segment_count = choose_segments(objects, t0, t1);
+
+	for (size_t n = 0; n < objects.size(); ++n)
+	{
+		aabb b;
+		objects[n]->bounding_box(t0, t1, b);
+		box = n ? surrounding_box(box, b) : b;
+	}
+
+	segments.resize(segment_count);
+	vector<aabb> keys[2];
+	keys[0].resize(objects.size());
+	keys[1].resize(objects.size());
+	for (int k = 0; k < segment_count; ++k)
+	{
+		double open = t0 + (t1 - t0) * k / segment_count;
+		double close = t0 + (t1 - t0) * (k + 1) / segment_count;
+
+		auto prims = gather_primitives(objects, 0, objects.size(), open, close);
+		for (size_t n = 0; n < objects.size(); ++n)
+		{
+			objects[n]->bounding_box(open, open, keys[0][n]);
+			objects[n]->bounding_box(close, close, keys[1][n]);
+		}
+		segments[k].build(prims, keys[0], keys[1], open, close, settings);
+	}
+}
+#endif // !MOTION_BVH_H
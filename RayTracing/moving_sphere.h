@@ -4,6 +4,7 @@
 
 #include "hittable.h"
 #include "vec3.h"
+#include "sphere.h"
 
 class moving_sphere : public hittable
 {
@@ -15,8 +16,26 @@ public:
 
 	moving_sphere() {}
 	moving_sphere(point3 center0, point3 center1, double time0, double time1, double radius, shared_ptr<material> m) : _center0(center0), _center1(center1), _time0(time0), _time1(time1), _radius(radius), mat_ptr(m) {};
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+	{
+		return hit_closest(*this, r, t_min, t_max, rec);
+	}
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec) const override
+	{
+		double root;
+		if (!sphere_root(r, center(r.time()), _radius, t_min, t_max, root))
+			return false;
+		c.t = root;
+		c.object = this;
+		return true;
+	}
+	virtual void resolve(const ray& r, const hit_candidate& c, hit_record& rec) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override
+	{
+		double root;
+		return sphere_root(r, center(r.time()), _radius, t_min, t_max, root);
+	}
 	point3 center(double time) const;
 };
 
@@ -29,36 +48,15 @@ point3 moving_sphere::center(double time) const
 /// calculate the hit point
 /// </summary>
 /// <param name="r"></param>
-/// <param name="t_min"></param>
-/// <param name="t_max"></param>
+/// <param name="c">the hit intersect() found</param>
 /// <param name="rec"></param>
-/// <returns></returns>
-bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+void moving_sphere::resolve(const ray& r, const hit_candidate& c, hit_record& rec) const
 {
-	vec3 oc = r.origin() - center(r.time());
-	auto a = dot(r.direction(), r.direction());
-	auto half_b = dot(oc, r.direction());
-	auto c = dot(oc, oc) - _radius * _radius;
-	auto delta = half_b * half_b - a * c;
-	if (delta < 0)
-		return false;
-	auto sqrt_delta = sqrt(delta);
-
-	auto root = (-half_b - sqrt_delta) / a;
-	if (root < t_min || t_max < root)
-	{
-		root = (-half_b + sqrt_delta) / a;
-		if (root < t_min || t_max < root)
-			return false;
-	}
-
-	rec.t = root;
+	rec.t = c.t;
 	rec.pt = r.at(rec.t);
 	vec3 outward_normal = (rec.pt - center(r.time())) / _radius;
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mat_ptr;
-
-	return true;
+	rec.mat_ptr = mat_ptr.get();
 }
 
 bool moving_sphere::bounding_box(double time0, double time1, aabb& output_box) const
@@ -0,0 +1,376 @@
+#pragma once
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include "triangle_mesh.h"
+#include "mapped_file.h"
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Reads the geometry of a Wavefront OBJ file: v, vt, vn and f records. Polygons are split
+// into triangle fans, negative (relative) indices are supported, everything else (groups,
+// materials, smoothing) is skipped.
+//
+// The file is mapped and cut into one chunk per core at line boundaries. Each chunk is
+// parsed on its own thread into its own buffers; a relative index is kept relative to the
+// chunk until the vertex counts of the chunks before it are known, and a second parallel
+// pass copies every chunk to its place in the mesh. Returns false if the file cannot be
+// read or a face refers to a vertex that does not exist.
+bool load_obj(const string& filename, triangle_mesh& mesh);
+
+namespace obj_detail
+{
+	// A face corner index as parsed: a plain 0-based index, a chunk-relative one (see
+	// encode_relative) or missing.
+	const int64_t missing_index = -1;
+	const int64_t relative_bias = int64_t(1) << 40;
+
+	inline int64_t encode_relative(int64_t local) { return local - relative_bias; }
+	inline bool is_relative(int64_t index) { return index < -(relative_bias >> 1); }
+
+	struct chunk
+	{
+		vector<float> position[3];
+		vector<float> normal[3];
+		vector<float> uv[2];
+		vector<int64_t> vertex_index[3];
+		vector<int64_t> normal_index[3];
+		vector<int64_t> uv_index[3];
+		// counts of the chunks before this one
+		size_t position_base = 0, normal_base = 0, uv_base = 0, triangle_base = 0;
+	};
+
+	inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+	inline void skip_space(const char*& p, const char* end)
+	{
+		while (p < end && is_space(*p))
+			++p;
+	}
+
+	// Decimal number with optional sign, fraction and exponent. Not correctly rounded in
+	// the last bit, which is far below what a float vertex keeps.
+	inline bool parse_float(const char*& p, const char* end, float& value)
+	{
+		skip_space(p, end);
+		const char* start = p;
+		bool negative = p < end && *p == '-';
+		if (p < end && (*p == '-' || *p == '+'))
+			++p;
+
+		uint64_t mantissa = 0;
+		int exponent = 0;
+		int digits = 0;
+		for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digits)
+		{
+			if (mantissa < 100000000000000000ull)
+				mantissa = mantissa * 10 + uint64_t(*p - '0');
+			else
+				++exponent;
+		}
+		if (p < end && *p == '.')
+		{
+			for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits)
+			{
+				if (mantissa < 100000000000000000ull)
+				{
+					mantissa = mantissa * 10 + uint64_t(*p - '0');
+					--exponent;
+				}
+			}
+		}
+		if (digits == 0)
+		{
+			p = start;
+			return false;
+		}
+		if (p < end && (*p == 'e' || *p == 'E'))
+		{
+			const char* e = p + 1;
+			bool negative_exponent = e < end && *e == '-';
+			if (e < end && (*e == '-' || *e == '+'))
+				++e;
+			if (e < end && *e >= '0' && *e <= '9')
+			{
+				int x = 0;
+				for (; e < end && *e >= '0' && *e <= '9'; ++e)
+					x = x < 10000 ? x * 10 + (*e - '0') : x;
+				exponent += negative_exponent ? -x : x;
+				p = e;
+			}
+		}
+
+		double v = double(mantissa);
+		if (exponent != 0)
+			v *= pow(10.0, exponent);
+		value = float(negative ? -v : v);
+		return true;
+	}
+
+	inline bool parse_int(const char*& p, const char* end, int64_t& value)
+	{
+		bool negative = p < end && *p == '-';
+		if (p < end && (*p == '-' || *p == '+'))
+			++p;
+		if (p >= end || *p < '0' || *p > '9')
+			return false;
+		value = 0;
+		for (; p < end && *p >= '0' && *p <= '9'; ++p)
+			value = value * 10 + (*p - '0');
+		if (negative)
+			value = -value;
+		return true;
+	}
+
+	// OBJ index (1-based, or negative counting back from the last element read) to a
+	// corner index; count is how many elements this chunk has read so far
+	inline int64_t corner_index(int64_t obj_index, size_t count)
+	{
+		if (obj_index > 0)
+			return obj_index - 1;
+		if (obj_index < 0)
+			return encode_relative(int64_t(count) + obj_index);
+		return missing_index;
+	}
+
+	inline void parse_chunk(const char* p, const char* end, chunk& out)
+	{
+		struct corner
+		{
+			int64_t v, t, n;
+		};
+		vector<corner> face;
+
+		while (p < end)
+		{
+			const char* line_end = p;
+			while (line_end < end && *line_end != '\n')
+				++line_end;
+
+			skip_space(p, line_end);
+			if (line_end - p >= 2 && p[0] == 'v' && is_space(p[1]))
+			{
+				p += 2;
+				float x[3] = { 0, 0, 0 };
+				for (int a = 0; a < 3; ++a)
+					parse_float(p, line_end, x[a]);
+				for (int a = 0; a < 3; ++a)
+					out.position[a].push_back(x[a]);
+			}
+			else if (line_end - p >= 3 && p[0] == 'v' && p[1] == 'n' && is_space(p[2]))
+			{
+				p += 3;
+				float x[3] = { 0, 0, 0 };
+				for (int a = 0; a < 3; ++a)
+					parse_float(p, line_end, x[a]);
+				for (int a = 0; a < 3; ++a)
+					out.normal[a].push_back(x[a]);
+			}
+			else if (line_end - p >= 3 && p[0] == 'v' && p[1] == 't' && is_space(p[2]))
+			{
+				p += 3;
+				float x[2] = { 0, 0 };
+				for (int a = 0; a < 2; ++a)
+					parse_float(p, line_end, x[a]);
+				for (int a = 0; a < 2; ++a)
+					out.uv[a].push_back(x[a]);
+			}
+			else if (line_end - p >= 2 && p[0] == 'f' && is_space(p[1]))
+			{
+				p += 2;
+				face.clear();
+				while (true)
+				{
+					skip_space(p, line_end);
+					int64_t v;
+					if (!parse_int(p, line_end, v))
+						break;
+					corner c{ corner_index(v, out.position[0].size()), missing_index, missing_index };
+					if (p < line_end && *p == '/')
+					{
+						++p;
+						int64_t t;
+						if (parse_int(p, line_end, t))
+							c.t = corner_index(t, out.uv[0].size());
+						if (p < line_end && *p == '/')
+						{
+							++p;
+							int64_t n;
+							if (parse_int(p, line_end, n))
+								c.n = corner_index(n, out.normal[0].size());
+						}
+					}
+					face.push_back(c);
+				}
+				for (size_t k = 2; k < face.size(); ++k)
+				{
+					const corner* tri[3] = { &face[0], &face[k - 1], &face[k] };
+					for (int i = 0; i < 3; ++i)
+					{
+						out.vertex_index[i].push_back(tri[i]->v);
+						out.uv_index[i].push_back(tri[i]->t);
+						out.normal_index[i].push_back(tri[i]->n);
+					}
+				}
+			}
+			p = line_end + 1;
+		}
+	}
+
+	// final index, or triangle_mesh::no_index if missing; false if out of range
+	inline bool resolve_index(int64_t index, size_t base, size_t total, uint32_t& result)
+	{
+		if (index == missing_index)
+		{
+			result = triangle_mesh::no_index;
+			return true;
+		}
+		if (is_relative(index))
+			index += relative_bias + int64_t(base);
+		if (index < 0 || index >= int64_t(total))
+			return false;
+		result = uint32_t(index);
+		return true;
+	}
+}
+
+bool load_obj(const string& filename, triangle_mesh& mesh)
+{
+	using namespace obj_detail;
+
+	mapped_file file;
+	if (!file.open(filename))
+		return false;
+	const char* text = reinterpret_cast<const char*>(file.data());
+	size_t size = file.size();
+
+	// chunk boundaries moved forward to the start of a line
+	size_t chunk_count = parallel_chunk_count(size, 1 << 20);
+	vector<size_t> bounds(chunk_count + 1, size);
+	for (size_t c = 0; c < chunk_count; ++c)
+	{
+		size_t b = size * c / chunk_count;
+		while (b > 0 && b < size && text[b - 1] != '\n')
+			++b;
+		bounds[c] = b;
+	}
+
+	vector<chunk> chunks(chunk_count);
+	parallel_chunks(chunk_count, chunk_count, [&](size_t, size_t first, size_t last)
+	{
+		for (size_t c = first; c < last; ++c)
+			parse_chunk(text + bounds[c], text + max(bounds[c], bounds[c + 1]), chunks[c]);
+	});
+
+	size_t positions = 0, normals = 0, uvs = 0, triangles = 0;
+	bool has_normals = false, has_uvs = false;
+	for (auto& c : chunks)
+	{
+		c.position_base = positions;
+		c.normal_base = normals;
+		c.uv_base = uvs;
+		c.triangle_base = triangles;
+		positions += c.position[0].size();
+		normals += c.normal[0].size();
+		uvs += c.uv[0].size();
+		triangles += c.vertex_index[0].size();
+		for (auto index : c.normal_index[0])
+			has_normals = has_normals || index != missing_index;
+		for (auto index : c.uv_index[0])
+			has_uvs = has_uvs || index != missing_index;
+	}
+	if (positions >= triangle_mesh::no_index || triangles >= triangle_mesh::no_index)
+		return false;
+
+	vector<float> position[3], normal[3], uv[2];
+	vector<uint32_t> vertex_index[3], normal_index[3], uv_index[3];
+	for (int a = 0; a < 3; ++a)
+	{
+		position[a].resize(positions);
+		vertex_index[a].resize(triangles);
+		if (has_normals)
+		{
+			normal[a].resize(normals);
+			normal_index[a].resize(triangles);
+		}
+		if (has_uvs)
+			uv_index[a].resize(triangles);
+	}
+	for (int a = 0; a < 2 && has_uvs; ++a)
+		uv[a].resize(uvs);
+
+	vector<char> chunk_valid(chunk_count, 1); // one flag per chunk, combined after the join
+	parallel_chunks(chunk_count, chunk_count, [&](size_t, size_t first, size_t last)
+	{
+		for (size_t n = first; n < last; ++n)
+		{
+			chunk& c = chunks[n];
+			for (int a = 0; a < 3; ++a)
+			{
+				copy(c.position[a].begin(), c.position[a].end(), position[a].begin() + c.position_base);
+				if (has_normals)
+					copy(c.normal[a].begin(), c.normal[a].end(), normal[a].begin() + c.normal_base);
+			}
+			for (int a = 0; a < 2 && has_uvs; ++a)
+				copy(c.uv[a].begin(), c.uv[a].end(), uv[a].begin() + c.uv_base);
+
+			bool valid = true;
+			for (size_t i = 0; i < c.vertex_index[0].size(); ++i)
+			{
+				size_t triangle = c.triangle_base + i;
+				for (int k = 0; k < 3; ++k)
+				{
+					valid = resolve_index(c.vertex_index[k][i], c.position_base, positions, vertex_index[k][triangle])
+						&& vertex_index[k][triangle] != triangle_mesh::no_index && valid;
+					if (has_normals)
+						valid = resolve_index(c.normal_index[k][i], c.normal_base, normals, normal_index[k][triangle]) && valid;
+					if (has_uvs)
+						valid = resolve_index(c.uv_index[k][i], c.uv_base, uvs, uv_index[k][triangle]) && valid;
+				}
+			}
+			chunk_valid[n] = valid;
+			c = chunk(); // free the chunk's buffers early
+		}
+	});
+	for (char valid : chunk_valid)
+		if (!valid)
+			return false;
+
+	// a triangle with only some of its corners' normals or uvs gets none
+	auto drop_partial = [&](vector<uint32_t>* indices)
+	{
+		for (size_t t = 0; t < triangles; ++t)
+		{
+			bool any = false, all = true;
+			for (int k = 0; k < 3; ++k)
+			{
+				any = any || indices[k][t] != triangle_mesh::no_index;
+				all = all && indices[k][t] != triangle_mesh::no_index;
+			}
+			if (any && !all)
+				indices[0][t] = indices[1][t] = indices[2][t] = triangle_mesh::no_index;
+		}
+	};
+	if (has_normals)
+		drop_partial(normal_index);
+	if (has_uvs)
+		drop_partial(uv_index);
+
+	for (int a = 0; a < 3; ++a)
+	{
+		mesh.position[a].assign(move(position[a]));
+		mesh.normal[a].assign(move(normal[a]));
+		mesh.vertex_index[a].assign(move(vertex_index[a]));
+		mesh.normal_index[a].assign(move(normal_index[a]));
+		mesh.uv_index[a].assign(move(uv_index[a]));
+	}
+	for (int a = 0; a < 2; ++a)
+		mesh.uv[a].assign(move(uv[a]));
+	return true;
+}
+#endif // !OBJ_LOADER_H
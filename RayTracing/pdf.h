@@ -14,15 +14,11 @@
 
 using namespace std;
 
-class pdf
-{
-public:
-    virtual ~pdf() {}
-    virtual double value(const vec3& direction) const = 0;
-    virtual vec3 generate() const = 0;
-};
+// The pdfs are small value types built on the stack for every bounce. They share the
+// interface value(direction) / generate() without a virtual base, so a mixture of two
+// of them is resolved at compile time and never touches the heap.
 
-class cosine_pdf : public pdf
+class cosine_pdf
 {
 public:
     onb uvw;
@@ -30,60 +26,66 @@ public:
     {
         uvw.build_from_w(w); // w: normal vector
     }
-    
-    virtual double value(const vec3& direction) const override
+
+    double value(const vec3& direction) const
     {
         auto cosine = dot(unit_vector(direction), uvw.w());
         return (cosine <= 0) ? 0 : cosine / pi;
     }
-    
-    virtual vec3 generate() const override
+
+    vec3 generate() const
     {
         return uvw.local(random_cosine_direction());
     }
 };
 
-class hittable_pdf : public pdf
+class hittable_pdf
 {
 public:
     point3 o;
-    shared_ptr<hittable> ptr;
-    
-    hittable_pdf(shared_ptr<hittable> p, const point3& origin) : ptr(p), o(origin) {}
-    
-    virtual double value(const vec3& direction) const override
+    const hittable* ptr; // not owned, the scene outlives every bounce
+
+    hittable_pdf(const hittable& p, const point3& origin) : o(origin), ptr(&p) {}
+
+    double value(const vec3& direction) const
     {
         return ptr->pdf_value(o, direction);
     }
-    
-    virtual vec3 generate() const override
+
+    vec3 generate() const
     {
         return ptr->random(o);
     }
 };
 
-class mixture_pdf : public pdf
+// picks p0 with probability weight and p1 otherwise
+template<typename pdf0, typename pdf1>
+class mixture_pdf
 {
 public:
-    shared_ptr<pdf> p[2];
+    pdf0 p0;
+    pdf1 p1;
+    double weight;
 
-    mixture_pdf(shared_ptr<pdf> p0, shared_ptr<pdf> p1)
-    {
-        p[0] = p0;
-        p[1] = p1;
-    }
+    mixture_pdf(const pdf0& _p0, const pdf1& _p1, double _weight = 0.5) : p0(_p0), p1(_p1), weight(_weight) {}
 
-    virtual double value(const vec3& direction) const override
+    double value(const vec3& direction) const
     {
-        return 0.7 * p[0]->value(direction) + 0.3 * p[1]->value(direction);
+        return weight * p0.value(direction) + (1 - weight) * p1.value(direction);
     }
 
-    virtual vec3 generate() const override
+    vec3 generate() const
     {
-        if (random_double() < 0.7)
-            return p[0]->generate();
+        if (random_double() < weight)
+            return p0.generate();
         else
-            return p[1]->generate();
+            return p1.generate();
     }
 };
+
+template<typename pdf0, typename pdf1>
+inline mixture_pdf<pdf0, pdf1> make_mixture_pdf(const pdf0& p0, const pdf1& p1, double weight)
+{
+    return mixture_pdf<pdf0, pdf1>(p0, p1, weight);
+}
 #endif /* pdf_h */
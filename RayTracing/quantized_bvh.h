@@ -0,0 +1,323 @@
+#pragma once
+#ifndef QUANTIZED_BVH_H
+#define QUANTIZED_BVH_H
+
+#include "wide_bvh.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+
+// BVH4 node with its child boxes quantized to 8 bits per plane: bound = origin + q * 2^exponent,
+// per axis. One cache line against 124 bytes for wide_bvh_node<4>.
+struct quantized_bvh4_node
+{
+	float origin[3];
+	int8_t exponent[3];
+	uint8_t num_children;
+	uint8_t bounds[2][3][4]; // [min, max][axis][child]
+	uint32_t child[4];       // as in wide_bvh_node
+	uint16_t count[4];
+};
+
+static_assert(sizeof(quantized_bvh4_node) == 64, "quantized_bvh4_node should fill one cache line");
+
+// 2^e for e in [-126, 127], built from its bits
+inline float exp2_float(int e)
+{
+	uint32_t bits = uint32_t(e + 127) << 23;
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+// Decoded plane side (0 min, 1 max) of child k on axis a. The origin is a multiple of the
+// step and every decoded plane fits in a float's mantissa, so decoding is exact in any
+// rounding mode and the planes are exactly the conservative ones chosen at build time.
+inline float quantized_bound(const quantized_bvh4_node& node, int side, int a, int k)
+{
+	return node.origin[a] + float(node.bounds[side][a][k]) * exp2_float(node.exponent[a]);
+}
+
+// Same as intersect_children for a wide_bvh_node<4>, decoding the boxes on the way.
+inline int intersect_children(const quantized_bvh4_node& node, const wide_ray& r, float t_min, float t_max, float* t_near)
+{
+#ifdef WIDE_BVH_USE_SSE2
+	__m128 t0 = _mm_set1_ps(t_min);
+	__m128 t1 = _mm_set1_ps(t_max);
+	const __m128 far_scale = _mm_set1_ps(wide_bvh_far_scale);
+	const __m128i zero = _mm_setzero_si128();
+	auto load = [&](const uint8_t* q, __m128 origin, __m128 step)
+	{
+		int32_t packed;
+		memcpy(&packed, q, sizeof(packed));
+		__m128i wide = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+		return _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(wide), step));
+	};
+	for (int a = 0; a < 3; ++a)
+	{
+		const __m128 origin = _mm_set1_ps(node.origin[a]);
+		const __m128 step = _mm_set1_ps(exp2_float(node.exponent[a]));
+		const __m128 o_near = _mm_set1_ps(r.origin_near[a]);
+		const __m128 o_far = _mm_set1_ps(r.origin_far[a]);
+		const __m128 inv = _mm_set1_ps(r.inv_dir[a]);
+		__m128 lo = _mm_mul_ps(_mm_sub_ps(load(node.bounds[r.dir_is_neg[a]][a], origin, step), o_near), inv);
+		__m128 hi = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(load(node.bounds[1 - r.dir_is_neg[a]][a], origin, step), o_far), inv), far_scale);
+		t0 = _mm_max_ps(lo, t0);
+		t1 = _mm_min_ps(hi, t1);
+	}
+	_mm_storeu_ps(t_near, t0);
+	return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & ((1 << node.num_children) - 1);
+#else
+	int mask = 0;
+	for (int k = 0; k < node.num_children; ++k)
+	{
+		float t0 = t_min;
+		float t1 = t_max;
+		for (int a = 0; a < 3; ++a)
+		{
+			float lo = (quantized_bound(node, r.dir_is_neg[a], a, k) - r.origin_near[a]) * r.inv_dir[a];
+			float hi = (quantized_bound(node, 1 - r.dir_is_neg[a], a, k) - r.origin_far[a]) * r.inv_dir[a] * wide_bvh_far_scale;
+			t0 = lo > t0 ? lo : t0;
+			t1 = hi < t1 ? hi : t1;
+		}
+		t_near[k] = t0;
+		if (t0 <= t1)
+			mask |= 1 << k;
+	}
+	return mask;
+#endif
+}
+
+// BVH4 with quantized nodes. Built as a wide_bvh_tree<4> and compressed node by node, so
+// the topology and slot order are the same; only the boxes grow, by less than one step.
+class quantized_bvh4_tree
+{
+public:
+	vector<quantized_bvh4_node> nodes;
+	vector<uint32_t> indices; // as in wide_bvh_tree
+
+	// fills the tree from a built wide_bvh_tree<4>, see the quantized_bvh4 constructor
+	void compress(const wide_bvh_tree<4>& wide);
+
+	// Same contract as flat_bvh_tree::traverse.
+	template<typename leaf_fn, typename stats_type = no_traversal_stats>
+	bool traverse(const ray& r, double t_min, double t_max, leaf_fn leaf, stats_type&& stats = stats_type()) const;
+};
+
+void quantized_bvh4_tree::compress(const wide_bvh_tree<4>& wide)
+{
+	nodes.resize(wide.nodes.size());
+	indices = wide.indices;
+
+	for (size_t i = 0; i < wide.nodes.size(); ++i)
+	{
+		const auto& src = wide.nodes[i];
+		auto& node = nodes[i];
+		node.num_children = src.num_children;
+		int n = src.num_children;
+
+		for (int a = 0; a < 3; ++a)
+		{
+			double lo = INFINITY, hi = -INFINITY;
+			for (int k = 0; k < n; ++k)
+			{
+				lo = fmin(lo, src.bounds[0][a][k]);
+				hi = fmax(hi, src.bounds[1][a][k]);
+			}
+
+			// Smallest step that spans the node in 255 steps and keeps every plane exact:
+			// planes are multiples of the step below 2^24 steps in magnitude.
+			double magnitude = fmax(fabs(lo), fabs(hi));
+			int e = magnitude > 0 ? ilogb(magnitude) - 22 : -126;
+			while (ldexp(255.0, e) < hi - lo)
+				++e;
+			e = e < -126 ? -126 : e;
+			double origin;
+			while (true)
+			{
+				origin = floor(ldexp(lo, -e)) * ldexp(1.0, e);
+				if (hi - origin <= ldexp(255.0, e))
+					break;
+				++e;
+			}
+			double step = ldexp(1.0, e);
+			node.origin[a] = float(origin);
+			node.exponent[a] = int8_t(e);
+
+			for (int k = 0; k < 4; ++k)
+			{
+				if (k >= n)
+				{
+					node.bounds[0][a][k] = 255;
+					node.bounds[1][a][k] = 0;
+					continue;
+				}
+				// round outward; origin + q * step is exact in double as well
+				int q_lo = int(floor((src.bounds[0][a][k] - origin) / step));
+				while (q_lo > 0 && origin + q_lo * step > src.bounds[0][a][k])
+					--q_lo;
+				int q_hi = int(ceil((src.bounds[1][a][k] - origin) / step));
+				while (q_hi < 255 && origin + q_hi * step < src.bounds[1][a][k])
+					++q_hi;
+				node.bounds[0][a][k] = uint8_t(q_lo < 0 ? 0 : q_lo);
+				node.bounds[1][a][k] = uint8_t(q_hi > 255 ? 255 : q_hi);
+			}
+		}
+
+		for (int k = 0; k < 4; ++k)
+		{
+			node.child[k] = src.child[k];
+			node.count[k] = src.count[k];
+		}
+	}
+}
+
+template<typename leaf_fn, typename stats_type>
+bool quantized_bvh4_tree::traverse(const ray& r, double t_min, double t_max, leaf_fn leaf, stats_type&& stats) const
+{
+	if (nodes.empty())
+		return false;
+
+	struct entry
+	{
+		uint32_t child;
+		uint16_t count;
+		float t_near;
+	};
+
+	wide_ray wr(r);
+	entry stack[bvh_stack_size * 4];
+	int stack_size = 0;
+	stack[stack_size++] = entry{ 0, 0, round_down(t_min) };
+	bool hit_anything = false;
+
+	while (stack_size > 0)
+	{
+		entry e = stack[--stack_size];
+		if (e.t_near > t_max)
+			continue;
+
+		if (e.count > 0)
+		{
+			for (uint32_t slot = e.child; slot < e.child + e.count; ++slot)
+			{
+				stats.test_primitive();
+				if (leaf(slot, t_min, t_max))
+				{
+					hit_anything = true;
+					if (t_max < t_min)
+						return true; // any-hit query done
+				}
+			}
+			continue;
+		}
+
+		const auto& node = nodes[e.child];
+		stats.visit_node();
+		float t_near[4];
+		int mask = intersect_children(node, wr, round_down(t_min), round_up(t_max), t_near);
+
+		// farthest first, as in wide_bvh_tree
+		int first = stack_size;
+		for (int k = 0; k < 4; ++k)
+		{
+			if (!(mask & (1 << k)))
+				continue;
+			entry c{ node.child[k], node.count[k], t_near[k] };
+			int p = stack_size++;
+			while (p > first && stack[p - 1].t_near < c.t_near)
+			{
+				stack[p] = stack[p - 1];
+				--p;
+			}
+			stack[p] = c;
+		}
+	}
+	return hit_anything;
+}
+
+// BVH4 over hittables with quantized nodes, for scenes whose tree does not fit in cache.
+class quantized_bvh4 : public hittable
+{
+public:
+	vector<shared_ptr<hittable>> objects;
+	quantized_bvh4_tree tree;
+	aabb box;
+
+	quantized_bvh4(const hittable_list& list, double time0, double time1, const bvh_build_settings& settings = bvh_build_settings())
+		: quantized_bvh4(list.objects, time0, time1, settings) {}
+	quantized_bvh4(const vector<shared_ptr<hittable>>& src_objects, double time0, double time1, const bvh_build_settings& settings = bvh_build_settings());
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+	{
+		return hit(r, t_min, t_max, rec, no_traversal_stats());
+	}
+
+	// hit() counting the nodes and primitives it tests into stats
+	template<typename stats_type>
+	bool hit(const ray& r, double t_min, double t_max, hit_record& rec, stats_type&& stats) const
+	{
+		hit_candidate c;
+		if (!intersect(r, t_min, t_max, c, rec, stats))
+			return false;
+		c.resolve(r, rec);
+		return true;
+	}
+
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec) const override
+	{
+		return intersect(r, t_min, t_max, c, rec, no_traversal_stats());
+	}
+
+	template<typename stats_type>
+	bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec, stats_type&& stats) const
+	{
+		return tree.traverse(r, t_min, t_max, [&](uint32_t slot, double t0, double& t1)
+		{
+			if (!objects[slot]->intersect(r, t0, t1, c, rec))
+				return false;
+			t1 = c.t;
+			return true;
+		}, stats);
+	}
+
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override
+	{
+		return tree.traverse(r, t_min, t_max, [&](uint32_t slot, double t0, double& t1)
+		{
+			if (!objects[slot]->occluded(r, t0, t1))
+				return false;
+			t1 = -infinity; // ends the walk
+			return true;
+		});
+	}
+
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
+	{
+		output_box = box;
+		return !objects.empty();
+	}
+};
+
+quantized_bvh4::quantized_bvh4(const vector<shared_ptr<hittable>>& src_objects, double time0, double time1, const bvh_build_settings& settings)
+{
+	if (src_objects.empty())
+		return;
+
+	auto prims = gather_primitives(src_objects, 0, src_objects.size(), time0, time1);
+	auto root = build_bvh(prims, settings);
+	wide_bvh_tree<4> wide;
+	wide.collapse(*root, prims);
+	tree.compress(wide);
+
+	objects.reserve(tree.indices.size());
+	for (auto index : tree.indices)
+		objects.push_back(src_objects[index]);
+
+	box = root->box;
+}
+#endif // !QUANTIZED_BVH_H
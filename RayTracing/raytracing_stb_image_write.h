@@ -0,0 +1,25 @@
+//
+//  raytracing_stb_image_write.h
+//  RayTracing
+//
+
+#ifndef raytracing_stb_image_write_h
+#define raytracing_stb_image_write_h
+
+// Disable pedantic warnings for this external library.
+#ifdef _MSC_VER
+    // Microsoft Visual C++ Compiler
+    #pragma warning (push, 0)
+#endif
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+// Restore warning levels.
+#ifdef _MSC_VER
+    // Microsoft Visual C++ Compiler
+    #pragma warning (pop)
+#endif
+
+
+#endif /* raytracing_stb_image_write_h */
@@ -5,6 +5,28 @@
 #include "hittable.h"
 #include "vec3.h"
 
+// nearest root of the ray-sphere quadratic in [t_min, t_max]
+inline bool sphere_root(const ray& r, const point3& center, double radius, double t_min, double t_max, double& root)
+{
+	vec3 oc = r.origin() - center;
+	auto a = dot(r.direction(), r.direction());
+	auto half_b = dot(oc, r.direction());
+	auto c = dot(oc, oc) - radius * radius;
+	auto delta = half_b * half_b - a * c;
+	if (delta < 0)
+		return false;
+	auto sqrt_delta = sqrt(delta);
+
+	root = (-half_b - sqrt_delta) / a;
+	if (root < t_min || t_max < root)
+	{
+		root = (-half_b + sqrt_delta) / a;
+		if (root < t_min || t_max < root)
+			return false;
+	}
+	return true;
+}
+
 class sphere : public hittable
 {
 public:
@@ -14,8 +36,26 @@ public:
 
 	sphere() {}
 	sphere(point3 center, double radius, shared_ptr<material> m) : _center(center), _radius(radius), mat_ptr(m) {};
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+	{
+		return hit_closest(*this, r, t_min, t_max, rec);
+	}
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec) const override
+	{
+		double root;
+		if (!sphere_root(r, _center, _radius, t_min, t_max, root))
+			return false;
+		c.t = root;
+		c.object = this;
+		return true;
+	}
+	virtual void resolve(const ray& r, const hit_candidate& c, hit_record& rec) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override
+	{
+		double root;
+		return sphere_root(r, _center, _radius, t_min, t_max, root);
+	}
 private:
 	static void get_sphere_uv(const point3& p, double& u, double& v)
 	{
@@ -37,37 +77,16 @@ private:
 /// calculate the hit point
 /// </summary>
 /// <param name="r"></param>
-/// <param name="t_min"></param>
-/// <param name="t_max"></param>
+/// <param name="c">the hit intersect() found</param>
 /// <param name="rec"></param>
-/// <returns></returns>
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+void sphere::resolve(const ray& r, const hit_candidate& c, hit_record& rec) const
 {
-	vec3 oc = r.origin() - _center;
-	auto a = dot(r.direction(), r.direction());
-	auto half_b = dot(oc, r.direction());
-	auto c = dot(oc, oc) - _radius * _radius;
-	auto delta = half_b * half_b - a * c;
-	if (delta < 0) 
-		return false;
-	auto sqrt_delta = sqrt(delta);
-
-	auto root = (-half_b - sqrt_delta) / a;
-	if (root < t_min || t_max < root)
-	{
-		root = (-half_b + sqrt_delta) / a;
-		if (root < t_min || t_max < root)
-			return false;
-	}
-
-	rec.t = root;
+	rec.t = c.t;
 	rec.pt = r.at(rec.t);
 	vec3 outward_normal = (rec.pt - _center) / _radius;
 	rec.set_face_normal(r, outward_normal);
 	get_sphere_uv(outward_normal, rec.u, rec.v);
-	rec.mat_ptr = mat_ptr;
-
-	return true;
+	rec.mat_ptr = mat_ptr.get();
 }
 
 bool sphere::bounding_box(double time0, double time1, aabb& output_box) const
@@ -0,0 +1,156 @@
+#pragma once
+#ifndef TILE_RENDERER_H
+#define TILE_RENDERER_H
+
+#include "vec3.h"
+#include "utils.h"
+#include "framebuffer.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+struct tile
+{
+	int index;
+	int x0, y0; // lower left pixel, inclusive
+	int x1, y1; // upper right pixel, exclusive
+};
+
+// A worker pops tiles from the back of its own queue and steals from the front of the others.
+class tile_queue
+{
+public:
+	void push(const tile& t)
+	{
+		lock_guard<mutex> guard(lock);
+		tiles.push_back(t);
+	}
+
+	bool pop(tile& t)
+	{
+		lock_guard<mutex> guard(lock);
+		if (tiles.empty())
+			return false;
+		t = tiles.back();
+		tiles.pop_back();
+		return true;
+	}
+
+	bool steal(tile& t)
+	{
+		lock_guard<mutex> guard(lock);
+		if (tiles.empty())
+			return false;
+		t = tiles.front();
+		tiles.pop_front();
+		return true;
+	}
+
+private:
+	mutex lock;
+	deque<tile> tiles;
+};
+
+class tile_renderer
+{
+public:
+	int image_width;
+	int image_height;
+	int tile_size;
+	int num_threads;
+	framebuffer image;
+
+	tile_renderer(int width, int height, int threads, int _tile_size = 16)
+		: image_width(width), image_height(height), tile_size(_tile_size), num_threads(threads > 0 ? threads : 1),
+		  image(width, height) {}
+
+	// shade(i, j) returns the linear color of pixel (i, j), j = 0 at the bottom. It must seed the random
+	// stream from the pixel (see seed_sample), so the image does not depend on the thread count.
+	template<typename shade_fn>
+	void render(shade_fn shade);
+
+private:
+	bool next_tile(vector<tile_queue>& queues, int self, tile& t) const;
+};
+
+bool tile_renderer::next_tile(vector<tile_queue>& queues, int self, tile& t) const
+{
+	if (queues[self].pop(t))
+		return true;
+
+	for (int k = 1; k < num_threads; ++k)
+	{
+		if (queues[(self + k) % num_threads].steal(t))
+			return true;
+	}
+	return false;
+}
+
+template<typename shade_fn>
+void tile_renderer::render(shade_fn shade)
+{
+	vector<tile_queue> queues(num_threads);
+
+	int tiles_x = (image_width + tile_size - 1) / tile_size;
+	int tiles_y = (image_height + tile_size - 1) / tile_size;
+	int tile_count = tiles_x * tiles_y;
+
+	// deal tiles round robin, starting from the top of the image
+	for (int n = 0; n < tile_count; ++n)
+	{
+		tile t;
+		t.index = n;
+		t.x0 = (n % tiles_x) * tile_size;
+		t.y1 = image_height - (n / tiles_x) * tile_size;
+		t.x1 = min(t.x0 + tile_size, image_width);
+		t.y0 = max(t.y1 - tile_size, 0);
+		queues[n % num_threads].push(t);
+	}
+
+	atomic<int> tiles_done(0);
+	mutex progress_lock;
+	condition_variable progress;
+
+	auto worker = [&](int self)
+	{
+		tile t;
+		while (next_tile(queues, self, t))
+		{
+			for (int j = t.y1 - 1; j >= t.y0; --j)
+				for (int i = t.x0; i < t.x1; ++i)
+					image.set(i, j, shade(i, j));
+			if (++tiles_done == tile_count)
+			{
+				lock_guard<mutex> guard(progress_lock);
+				progress.notify_one();
+			}
+		}
+	};
+
+	vector<thread> workers;
+	for (int n = 0; n < num_threads; ++n)
+		workers.emplace_back(worker, n);
+
+	// report progress every 100 ms, but wake up as soon as the last tile is done
+	{
+		unique_lock<mutex> guard(progress_lock);
+		while (tiles_done < tile_count)
+		{
+			cerr << "\rTiles remaining: " << tile_count - tiles_done << ' ' << flush;
+			progress.wait_for(guard, chrono::milliseconds(100), [&] { return tiles_done == tile_count; });
+		}
+	}
+	cerr << "\rTiles remaining: 0 " << flush;
+
+	for (auto& w : workers)
+		w.join();
+}
+#endif // !TILE_RENDERER_H
@@ -0,0 +1,248 @@
+#pragma once
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "hittable.h"
+#include "flat_bvh.h"
+#include "mapped_file.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+// Ray set up once for the watertight ray-triangle test of Woop, Benthin and Wald (2013):
+// the axis the direction is longest along becomes z, and a shear takes the direction to
+// +z, so each triangle is tested in 2D with edge functions that agree along shared edges.
+struct watertight_ray
+{
+	int kx, ky, kz;
+	double sx, sy, sz;
+	point3 origin;
+
+	watertight_ray(const ray& r) : origin(r.origin())
+	{
+		const vec3& d = r.direction();
+		kz = fabs(d.x()) > fabs(d.y()) ? (fabs(d.x()) > fabs(d.z()) ? 0 : 2) : (fabs(d.y()) > fabs(d.z()) ? 1 : 2);
+		kx = kz == 2 ? 0 : kz + 1;
+		ky = kx == 2 ? 0 : kx + 1;
+		sx = -d[kx] / d[kz];
+		sy = -d[ky] / d[kz];
+		sz = 1.0 / d[kz];
+	}
+};
+
+// Indexed triangle mesh. Vertex attributes and per-corner indices are kept as structure
+// of arrays, and the mesh carries its own BVH over the triangles, so a mesh of millions of
+// faces is one object to the scene's tree. Triangles are stored in the BVH's leaf order,
+// so the tree needs no slot indices. The buffers can be mapped from a file, see mesh_file.h.
+class triangle_mesh : public hittable
+{
+public:
+	static const uint32_t no_index = 0xffffffffu;
+
+	// owned after loading, or views into a mapped file
+	mappable_vector<float> position[3];         // x, y, z of every vertex
+	mappable_vector<float> normal[3];           // empty if the mesh has no normals
+	mappable_vector<float> uv[2];               // empty if the mesh has no texture coordinates
+	mappable_vector<uint32_t> vertex_index[3];  // corner k of every triangle
+	mappable_vector<uint32_t> normal_index[3];  // empty, or no_index for a triangle without normals
+	mappable_vector<uint32_t> uv_index[3];      // same for texture coordinates
+	flat_bvh_tree tree;
+	aabb box;
+	shared_ptr<material> mat_ptr;
+
+	size_t triangle_count() const { return vertex_index[0].size(); }
+	size_t vertex_count() const { return position[0].size(); }
+
+	// Builds the BVH over the triangles and puts them in leaf order. Call once the buffers
+	// are filled. The sbvh builder is replaced by the SAH one, see build().
+	void build(const bvh_build_settings& settings = bvh_build_settings());
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+	{
+		return hit_closest(*this, r, t_min, t_max, rec);
+	}
+
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec) const override
+	{
+		watertight_ray wr(r);
+		return tree.traverse(r, t_min, t_max, [&](uint32_t slot, double t0, double& t1)
+		{
+			double t, b1, b2;
+			if (!intersect_triangle(wr, slot, t0, t1, t, b1, b2))
+				return false;
+			c.t = t1 = t;
+			c.u = b1;
+			c.v = b2;
+			c.primitive = slot;
+			c.object = this;
+			return true;
+		});
+	}
+
+	virtual void resolve(const ray& r, const hit_candidate& c, hit_record& rec) const override;
+
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override
+	{
+		watertight_ray wr(r);
+		return tree.traverse(r, t_min, t_max, [&](uint32_t slot, double t0, double& t1)
+		{
+			double t, b1, b2;
+			if (!intersect_triangle(wr, slot, t0, t1, t, b1, b2))
+				return false;
+			t1 = -infinity; // ends the walk
+			return true;
+		});
+	}
+
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
+	{
+		output_box = box;
+		return triangle_count() > 0;
+	}
+
+	point3 vertex(uint32_t index) const
+	{
+		return point3(position[0][index], position[1][index], position[2][index]);
+	}
+
+	// distance and barycentrics of corners 1 and 2 if r hits triangle within [t_min, t_max]
+	bool intersect_triangle(const watertight_ray& r, uint32_t triangle, double t_min, double t_max, double& t, double& b1, double& b2) const;
+};
+
+void triangle_mesh::build(const bvh_build_settings& settings)
+{
+	size_t n = triangle_count();
+	vector<bvh_primitive> prims(n);
+	parallel_chunks(n, parallel_chunk_count(n), [&](size_t, size_t first, size_t last)
+	{
+		for (size_t i = first; i < last; ++i)
+		{
+			point3 p0 = vertex(vertex_index[0][i]);
+			point3 p1 = vertex(vertex_index[1][i]);
+			point3 p2 = vertex(vertex_index[2][i]);
+			point3 lo, hi;
+			for (int a = 0; a < 3; ++a)
+			{
+				lo[a] = fmin(p0[a], fmin(p1[a], p2[a]));
+				hi[a] = fmax(p0[a], fmax(p1[a], p2[a]));
+			}
+			prims[i].box = aabb(lo, hi);
+			prims[i].centroid = prims[i].box.centroid();
+			prims[i].index = i;
+		}
+	});
+
+	if (n == 0)
+	{
+		tree = flat_bvh_tree();
+		return;
+	}
+
+	// Slots are triangles, so a triangle can sit in one leaf only: spatial splits would
+	// duplicate it in the index buffers. Meshes use the SAH builder instead of the sbvh.
+	bvh_build_settings mesh_settings = settings;
+	if (mesh_settings.builder == bvh_builder_type::sbvh)
+		mesh_settings.builder = bvh_builder_type::sah;
+	auto root = build_bvh(prims, mesh_settings);
+	tree.flatten(*root, prims);
+	box = root->box;
+
+	// leaf order, so that slot == triangle
+	auto reorder = [&](mappable_vector<uint32_t>& values)
+	{
+		if (values.empty())
+			return;
+		vector<uint32_t> sorted(tree.indices.size());
+		for (size_t slot = 0; slot < sorted.size(); ++slot)
+			sorted[slot] = values[tree.indices[slot]];
+		values.assign(move(sorted));
+	};
+	for (int k = 0; k < 3; ++k)
+	{
+		reorder(vertex_index[k]);
+		reorder(normal_index[k]);
+		reorder(uv_index[k]);
+	}
+	tree.indices.clear(); // slot == triangle from here on
+}
+
+bool triangle_mesh::intersect_triangle(const watertight_ray& r, uint32_t triangle, double t_min, double t_max, double& t, double& b1, double& b2) const
+{
+	// corners relative to the ray origin, permuted and sheared so the ray runs along +z
+	double x[3], y[3], z[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		uint32_t v = vertex_index[k][triangle];
+		double p[3] = { position[0][v] - r.origin[0], position[1][v] - r.origin[1], position[2][v] - r.origin[2] };
+		z[k] = p[r.kz];
+		x[k] = p[r.kx] + r.sx * z[k];
+		y[k] = p[r.ky] + r.sy * z[k];
+	}
+
+	// edge functions; a ray through an edge or vertex gets the same sign from both
+	// triangles sharing it, so it cannot slip between them
+	double e0 = x[1] * y[2] - y[1] * x[2];
+	double e1 = x[2] * y[0] - y[2] * x[0];
+	double e2 = x[0] * y[1] - y[0] * x[1];
+	if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
+		return false;
+	double det = e0 + e1 + e2;
+	if (det == 0)
+		return false;
+
+	// compare the scaled distance against the scaled range before dividing
+	double t_scaled = (e0 * z[0] + e1 * z[1] + e2 * z[2]) * r.sz;
+	if (det < 0 ? (t_scaled > t_min * det || t_scaled < t_max * det) : (t_scaled < t_min * det || t_scaled > t_max * det))
+		return false;
+
+	double inv_det = 1.0 / det;
+	t = t_scaled * inv_det;
+	b1 = e1 * inv_det;
+	b2 = e2 * inv_det;
+	return true;
+}
+
+void triangle_mesh::resolve(const ray& r, const hit_candidate& c, hit_record& rec) const
+{
+	uint32_t triangle = c.primitive;
+	double b[3] = { 1 - c.u - c.v, c.u, c.v };
+	uint32_t v[3] = { vertex_index[0][triangle], vertex_index[1][triangle], vertex_index[2][triangle] };
+
+	rec.t = c.t;
+	rec.pt = r.at(c.t);
+
+	vec3 outward_normal = unit_vector(cross(vertex(v[1]) - vertex(v[0]), vertex(v[2]) - vertex(v[0])));
+	if (!normal[0].empty() && normal_index[0][triangle] != no_index)
+	{
+		vec3 shading(0, 0, 0);
+		for (int k = 0; k < 3; ++k)
+		{
+			uint32_t n = normal_index[k][triangle];
+			shading += b[k] * vec3(normal[0][n], normal[1][n], normal[2][n]);
+		}
+		if (shading.length_squared() > 0)
+			outward_normal = unit_vector(shading);
+	}
+	rec.set_face_normal(r, outward_normal);
+
+	if (!uv[0].empty() && uv_index[0][triangle] != no_index)
+	{
+		rec.u = rec.v = 0;
+		for (int k = 0; k < 3; ++k)
+		{
+			uint32_t n = uv_index[k][triangle];
+			rec.u += b[k] * uv[0][n];
+			rec.v += b[k] * uv[1][n];
+		}
+	}
+	else
+	{
+		rec.u = c.u;
+		rec.v = c.v;
+	}
+	rec.mat_ptr = mat_ptr.get();
+}
+#endif // !TRIANGLE_MESH_H
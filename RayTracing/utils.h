@@ -17,11 +17,53 @@ inline double degrees_to_radians(double degrees)
 }
 
 
-#include <cstdlib>
+#include <cstdint>
+
+// Counter-based generator: each draw hashes a (key, counter) pair with the
+// SplitMix64 finalizer, so a sample's random numbers depend only on which pixel,
+// sample and bounce they belong to, never on thread scheduling or the platform.
+struct random_stream
+{
+	uint64_t sample_key = 0;
+	uint64_t key = 0;
+	uint64_t counter = 0;
+};
+
+inline random_stream& thread_random_stream()
+{
+	static thread_local random_stream stream;
+	return stream;
+}
+
+inline uint64_t mix64(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+// start the stream of a camera sample; bounces branch off it with seed_bounce
+inline void seed_sample(uint64_t pixel, uint64_t sample)
+{
+	auto& stream = thread_random_stream();
+	stream.sample_key = mix64(mix64(pixel + 1) ^ (sample * 0x9e3779b97f4a7c15ULL));
+	stream.key = stream.sample_key;
+	stream.counter = 0;
+}
+
+// every bounce gets its own stream, so a rejection loop at one vertex does not shift the next
+inline void seed_bounce(int bounce)
+{
+	auto& stream = thread_random_stream();
+	stream.key = mix64(stream.sample_key + (uint64_t(bounce) + 1) * 0xd1b54a32d192ed03ULL);
+	stream.counter = 0;
+}
 
 inline double random_double()
 {
-	return rand() / (RAND_MAX + 1.0);
+	auto& stream = thread_random_stream();
+	uint64_t bits = mix64(stream.key + (++stream.counter) * 0x9e3779b97f4a7c15ULL);
+	return (bits >> 11) * (1.0 / 9007199254740992.0); // 53 random bits in [0, 1)
 }
 
 inline double random_double(double min, double max)
@@ -0,0 +1,381 @@
+#pragma once
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "flat_bvh.h"
+
+#include <cstdint>
+#include <cfloat>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define WIDE_BVH_USE_SSE2
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#define WIDE_BVH_USE_AVX
+#endif
+
+using namespace std;
+
+// Node with up to N children whose boxes are stored as structure of arrays, so one
+// vector instruction per slab tests all children. Children are packed at the front.
+template<int N>
+struct wide_bvh_node
+{
+	float bounds[2][3][N]; // [min, max][axis][child]
+	uint32_t child[N];     // interior child: node index; leaf child: first primitive slot
+	uint16_t count[N];     // primitives of a leaf child, 0 for an interior child
+	uint8_t num_children;
+};
+
+// The ray in single precision. The origin is rounded down and up, and each slab plane
+// is measured from the rounding that moves it outward, so the absolute error of a float
+// origin cannot cull a thin box next to it. What is left is relative error, which the
+// few ulps tfar is widened by cover.
+struct wide_ray
+{
+	float origin_near[3]; // for the plane the ray enters a slab through
+	float origin_far[3];  // for the plane it leaves through
+	float inv_dir[3];
+	int dir_is_neg[3];
+
+	wide_ray(const ray& r)
+	{
+		for (int a = 0; a < 3; ++a)
+		{
+			inv_dir[a] = float(1.0 / r.direction()[a]);
+			dir_is_neg[a] = inv_dir[a] < 0;
+			float lo = round_down(r.origin()[a]);
+			float hi = round_up(r.origin()[a]);
+			origin_near[a] = dir_is_neg[a] ? lo : hi;
+			origin_far[a] = dir_is_neg[a] ? hi : lo;
+		}
+	}
+};
+
+const float wide_bvh_far_scale = 1.0f + 4 * FLT_EPSILON;
+
+// Tests all children of node against the ray. Returns a bit mask of the children hit and
+// writes their entry distances to t_near.
+template<int N>
+inline int intersect_children(const wide_bvh_node<N>& node, const wide_ray& r, float t_min, float t_max, float* t_near)
+{
+	int mask = 0;
+	for (int k = 0; k < node.num_children; ++k)
+	{
+		float t0 = t_min;
+		float t1 = t_max;
+		for (int a = 0; a < 3; ++a)
+		{
+			float lo = (node.bounds[r.dir_is_neg[a]][a][k] - r.origin_near[a]) * r.inv_dir[a];
+			float hi = (node.bounds[1 - r.dir_is_neg[a]][a][k] - r.origin_far[a]) * r.inv_dir[a] * wide_bvh_far_scale;
+			t0 = lo > t0 ? lo : t0;
+			t1 = hi < t1 ? hi : t1;
+		}
+		t_near[k] = t0;
+		if (t0 <= t1)
+			mask |= 1 << k;
+	}
+	return mask;
+}
+
+#ifdef WIDE_BVH_USE_SSE2
+// Slab test of the four children starting at first. max/min return their second operand
+// when the first is NaN (0 * inf on a slab plane), so the running interval is kept.
+template<int N>
+inline int sse_slab_test(const wide_bvh_node<N>& node, int first, const wide_ray& r, float t_min, float t_max, float* t_near)
+{
+	__m128 t0 = _mm_set1_ps(t_min);
+	__m128 t1 = _mm_set1_ps(t_max);
+	const __m128 far_scale = _mm_set1_ps(wide_bvh_far_scale);
+	for (int a = 0; a < 3; ++a)
+	{
+		const __m128 o_near = _mm_set1_ps(r.origin_near[a]);
+		const __m128 o_far = _mm_set1_ps(r.origin_far[a]);
+		const __m128 inv = _mm_set1_ps(r.inv_dir[a]);
+		__m128 lo = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[r.dir_is_neg[a]][a] + first), o_near), inv);
+		__m128 hi = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[1 - r.dir_is_neg[a]][a] + first), o_far), inv), far_scale);
+		t0 = _mm_max_ps(lo, t0);
+		t1 = _mm_min_ps(hi, t1);
+	}
+	_mm_storeu_ps(t_near + first, t0);
+	return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << first;
+}
+
+template<>
+inline int intersect_children<4>(const wide_bvh_node<4>& node, const wide_ray& r, float t_min, float t_max, float* t_near)
+{
+	return sse_slab_test(node, 0, r, t_min, t_max, t_near) & ((1 << node.num_children) - 1);
+}
+
+template<>
+inline int intersect_children<8>(const wide_bvh_node<8>& node, const wide_ray& r, float t_min, float t_max, float* t_near)
+{
+#ifdef WIDE_BVH_USE_AVX
+	__m256 t0 = _mm256_set1_ps(t_min);
+	__m256 t1 = _mm256_set1_ps(t_max);
+	const __m256 far_scale = _mm256_set1_ps(wide_bvh_far_scale);
+	for (int a = 0; a < 3; ++a)
+	{
+		const __m256 o_near = _mm256_set1_ps(r.origin_near[a]);
+		const __m256 o_far = _mm256_set1_ps(r.origin_far[a]);
+		const __m256 inv = _mm256_set1_ps(r.inv_dir[a]);
+		__m256 lo = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[r.dir_is_neg[a]][a]), o_near), inv);
+		__m256 hi = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[1 - r.dir_is_neg[a]][a]), o_far), inv), far_scale);
+		t0 = _mm256_max_ps(lo, t0);
+		t1 = _mm256_min_ps(hi, t1);
+	}
+	_mm256_storeu_ps(t_near, t0);
+	return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) & ((1 << node.num_children) - 1);
+#else
+	int mask = sse_slab_test(node, 0, r, t_min, t_max, t_near) | sse_slab_test(node, 4, r, t_min, t_max, t_near);
+	return mask & ((1 << node.num_children) - 1);
+#endif
+}
+#endif
+
+// BVH4 / BVH8 collapsed from a binary build tree.
+template<int N>
+class wide_bvh_tree
+{
+public:
+	vector<wide_bvh_node<N>> nodes;
+	vector<uint32_t> indices; // slot -> index into the primitive array handed to build()
+
+	void build(vector<bvh_primitive>& prims, const bvh_build_settings& settings = bvh_build_settings())
+	{
+		auto root = build_bvh(prims, settings);
+		collapse(*root, prims);
+	}
+
+	void collapse(const bvh_build_node& root, const vector<bvh_primitive>& prims);
+
+	// Same contract as flat_bvh_tree::traverse.
+	template<typename leaf_fn, typename stats_type = no_traversal_stats>
+	bool traverse(const ray& r, double t_min, double t_max, leaf_fn leaf, stats_type&& stats = stats_type()) const;
+
+private:
+	uint32_t collapse_node(const bvh_build_node* const* children, int num_children, const vector<bvh_primitive>& prims);
+};
+
+template<int N>
+void wide_bvh_tree<N>::collapse(const bvh_build_node& root, const vector<bvh_primitive>& prims)
+{
+	nodes.clear();
+	indices.clear();
+	const bvh_build_node* top = &root;
+	collapse_node(&top, 1, prims);
+}
+
+template<int N>
+uint32_t wide_bvh_tree<N>::collapse_node(const bvh_build_node* const* children, int num_children, const vector<bvh_primitive>& prims)
+{
+	// open the interior child with the largest surface area until the node is full
+	const bvh_build_node* kids[N];
+	int n = 0;
+	for (int k = 0; k < num_children; ++k)
+		kids[n++] = children[k];
+
+	while (n < N)
+	{
+		int widest = -1;
+		for (int k = 0; k < n; ++k)
+		{
+			if (!kids[k]->is_leaf() && (widest < 0 || kids[k]->box.surface_area() > kids[widest]->box.surface_area()))
+				widest = k;
+		}
+		if (widest < 0)
+			break;
+		const bvh_build_node* opened = kids[widest];
+		kids[widest] = opened->children[0].get();
+		kids[n++] = opened->children[1].get();
+	}
+
+	uint32_t index = uint32_t(nodes.size());
+	nodes.emplace_back();
+
+	wide_bvh_node<N> node;
+	node.num_children = uint8_t(n);
+	for (int k = 0; k < N; ++k)
+	{
+		for (int a = 0; a < 3; ++a)
+		{
+			// empty slots get an inverted box that no ray can enter
+			node.bounds[0][a][k] = k < n ? round_down(kids[k]->box.min()[a]) : INFINITY;
+			node.bounds[1][a][k] = k < n ? round_up(kids[k]->box.max()[a]) : -INFINITY;
+		}
+		node.child[k] = 0;
+		node.count[k] = 0;
+	}
+
+	for (int k = 0; k < n; ++k)
+	{
+		if (kids[k]->is_leaf())
+		{
+			node.child[k] = uint32_t(indices.size());
+			node.count[k] = uint16_t(kids[k]->count);
+			for (size_t p = kids[k]->first; p < kids[k]->first + kids[k]->count; ++p)
+				indices.push_back(uint32_t(prims[p].index));
+		}
+		else
+		{
+			const bvh_build_node* grand[2] = { kids[k]->children[0].get(), kids[k]->children[1].get() };
+			node.child[k] = collapse_node(grand, 2, prims);
+		}
+	}
+
+	nodes[index] = node;
+	return index;
+}
+
+template<int N>
+template<typename leaf_fn, typename stats_type>
+bool wide_bvh_tree<N>::traverse(const ray& r, double t_min, double t_max, leaf_fn leaf, stats_type&& stats) const
+{
+	if (nodes.empty())
+		return false;
+
+	struct entry
+	{
+		uint32_t child;
+		uint16_t count;
+		float t_near;
+	};
+
+	wide_ray wr(r);
+	entry stack[bvh_stack_size * N];
+	int stack_size = 0;
+	stack[stack_size++] = entry{ 0, 0, round_down(t_min) };
+	bool hit_anything = false;
+
+	while (stack_size > 0)
+	{
+		entry e = stack[--stack_size];
+		if (e.t_near > t_max)
+			continue; // a closer hit was found after this entry was pushed
+
+		if (e.count > 0)
+		{
+			for (uint32_t slot = e.child; slot < e.child + e.count; ++slot)
+			{
+				stats.test_primitive();
+				if (leaf(slot, t_min, t_max))
+				{
+					hit_anything = true;
+					if (t_max < t_min)
+						return true; // any-hit query done
+				}
+			}
+			continue;
+		}
+
+		const auto& node = nodes[e.child];
+		stats.visit_node();
+		float t_near[N];
+		int mask = intersect_children(node, wr, round_down(t_min), round_up(t_max), t_near);
+
+		// push the hit children farthest first, so the nearest is popped next
+		int first = stack_size;
+		for (int k = 0; k < N; ++k)
+		{
+			if (!(mask & (1 << k)))
+				continue;
+			entry c{ node.child[k], node.count[k], t_near[k] };
+			int p = stack_size++;
+			while (p > first && stack[p - 1].t_near < c.t_near)
+			{
+				stack[p] = stack[p - 1];
+				--p;
+			}
+			stack[p] = c;
+		}
+	}
+	return hit_anything;
+}
+
+// Wide BVH over hittables, objects stored in leaf order like flat_bvh.
+template<int N>
+class wide_bvh : public hittable
+{
+public:
+	vector<shared_ptr<hittable>> objects;
+	wide_bvh_tree<N> tree;
+	aabb box;
+
+	wide_bvh(const hittable_list& list, double time0, double time1, const bvh_build_settings& settings = bvh_build_settings())
+		: wide_bvh(list.objects, time0, time1, settings) {}
+	wide_bvh(const vector<shared_ptr<hittable>>& src_objects, double time0, double time1, const bvh_build_settings& settings = bvh_build_settings());
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+	{
+		return hit(r, t_min, t_max, rec, no_traversal_stats());
+	}
+
+	// hit() counting the nodes and primitives it tests into stats
+	template<typename stats_type>
+	bool hit(const ray& r, double t_min, double t_max, hit_record& rec, stats_type&& stats) const
+	{
+		hit_candidate c;
+		if (!intersect(r, t_min, t_max, c, rec, stats))
+			return false;
+		c.resolve(r, rec);
+		return true;
+	}
+
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec) const override
+	{
+		return intersect(r, t_min, t_max, c, rec, no_traversal_stats());
+	}
+
+	template<typename stats_type>
+	bool intersect(const ray& r, double t_min, double t_max, hit_candidate& c, hit_record& rec, stats_type&& stats) const
+	{
+		return tree.traverse(r, t_min, t_max, [&](uint32_t slot, double t0, double& t1)
+		{
+			if (!objects[slot]->intersect(r, t0, t1, c, rec))
+				return false;
+			t1 = c.t;
+			return true;
+		}, stats);
+	}
+
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override
+	{
+		return tree.traverse(r, t_min, t_max, [&](uint32_t slot, double t0, double& t1)
+		{
+			if (!objects[slot]->occluded(r, t0, t1))
+				return false;
+			t1 = -infinity; // ends the walk
+			return true;
+		});
+	}
+
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
+	{
+		output_box = box;
+		return !objects.empty();
+	}
+};
+
+template<int N>
+wide_bvh<N>::wide_bvh(const vector<shared_ptr<hittable>>& src_objects, double time0, double time1, const bvh_build_settings& settings)
+{
+	if (src_objects.empty())
+		return;
+
+	auto prims = gather_primitives(src_objects, 0, src_objects.size(), time0, time1);
+	auto root = build_bvh(prims, settings);
+	tree.collapse(*root, prims);
+
+	objects.reserve(tree.indices.size());
+	for (auto index : tree.indices)
+		objects.push_back(src_objects[index]);
+
+	box = root->box;
+}
+
+using bvh4 = wide_bvh<4>;
+using bvh8 = wide_bvh<8>;
+#endif // !WIDE_BVH_H